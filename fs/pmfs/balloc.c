@@ -21,8 +21,348 @@
 
 #include <linux/fs.h>
 #include <linux/bitops.h>
+#include <linux/sort.h>
+#include <linux/rbtree_augmented.h>
+#include <linux/string.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
 #include "pmfs.h"
 
+/*
+ * The in-use blocknodes are kept both on the sorted block_inuse_head list
+ * and in block_inuse_tree, an rbtree keyed by block_low.  Each node records
+ * the number of free blocks between its block_high and the next node (or
+ * block_end), and the tree is augmented with the largest such gap in every
+ * subtree, so that first-fit allocation and frees are O(log n).
+ *
+ * To keep free aligned 2M and 1G regions intact for huge block files and
+ * huge mappings, each node also records, for both region sizes, how many
+ * free blocks at the edges of its gap lie in regions that are already
+ * partly in use (room[]), and the tree is augmented with the maximum of
+ * those too.  Small allocations are steered into that room first.  Huge
+ * block allocations need their runs aligned, so the tree also keeps the
+ * largest part of a gap that starts on a 2M or 1G boundary (aligned[]).
+ */
+static inline unsigned long pmfs_region_blocks(int region)
+{
+	return pmfs_get_numblocks(region + PMFS_BLOCK_TYPE_2M);
+}
+
+/* Recomputes the subtree maxima of i from its children.  Returns true if
+ * any of them changed. */
+static bool pmfs_compute_subtree(struct pmfs_blocknode *i)
+{
+	struct rb_node *children[2] = { i->node.rb_left, i->node.rb_right };
+	struct pmfs_blocknode *child;
+	unsigned long gap = i->gap;
+	unsigned long room[PMFS_NR_REGIONS], aligned[PMFS_NR_REGIONS];
+	bool changed;
+	int c, r;
+
+	for (r = 0; r < PMFS_NR_REGIONS; r++) {
+		room[r] = i->room[r];
+		aligned[r] = i->aligned[r];
+	}
+	for (c = 0; c < 2; c++) {
+		if (!children[c])
+			continue;
+		child = rb_entry(children[c], struct pmfs_blocknode, node);
+		gap = max(gap, child->subtree_gap);
+		for (r = 0; r < PMFS_NR_REGIONS; r++) {
+			room[r] = max(room[r], child->subtree_room[r]);
+			aligned[r] = max(aligned[r], child->subtree_aligned[r]);
+		}
+	}
+
+	changed = i->subtree_gap != gap;
+	i->subtree_gap = gap;
+	for (r = 0; r < PMFS_NR_REGIONS; r++) {
+		changed |= i->subtree_room[r] != room[r];
+		i->subtree_room[r] = room[r];
+		changed |= i->subtree_aligned[r] != aligned[r];
+		i->subtree_aligned[r] = aligned[r];
+	}
+	return changed;
+}
+
+static void pmfs_gap_propagate(struct rb_node *rb, struct rb_node *stop)
+{
+	while (rb != stop) {
+		struct pmfs_blocknode *i = rb_entry(rb, struct pmfs_blocknode,
+						    node);
+
+		if (!pmfs_compute_subtree(i))
+			break;
+		rb = rb_parent(&i->node);
+	}
+}
+
+static void pmfs_gap_copy(struct rb_node *rb_old, struct rb_node *rb_new)
+{
+	struct pmfs_blocknode *old = rb_entry(rb_old, struct pmfs_blocknode,
+					      node);
+	struct pmfs_blocknode *new = rb_entry(rb_new, struct pmfs_blocknode,
+					      node);
+	int r;
+
+	new->subtree_gap = old->subtree_gap;
+	for (r = 0; r < PMFS_NR_REGIONS; r++) {
+		new->subtree_room[r] = old->subtree_room[r];
+		new->subtree_aligned[r] = old->subtree_aligned[r];
+	}
+}
+
+static void pmfs_gap_rotate(struct rb_node *rb_old, struct rb_node *rb_new)
+{
+	pmfs_gap_copy(rb_old, rb_new);
+	pmfs_compute_subtree(rb_entry(rb_old, struct pmfs_blocknode, node));
+}
+
+static const struct rb_augment_callbacks pmfs_gap_callbacks = {
+	pmfs_gap_propagate, pmfs_gap_copy, pmfs_gap_rotate
+};
+
+static struct pmfs_blocknode *pmfs_next_blocknode(struct pmfs_blocknode *i,
+						  struct list_head *head)
+{
+	if (list_is_last(&i->link, head))
+		return NULL;
+	return list_first_entry(&i->link, typeof(*i), link);
+}
+
+static struct pmfs_blocknode *pmfs_prev_blocknode(struct pmfs_blocknode *i,
+						  struct list_head *head)
+{
+	if (i->link.prev == head)
+		return NULL;
+	return list_entry(i->link.prev, typeof(*i), link);
+}
+
+/* Free blocks at the edges of the gap after i that lie in regions of the
+ * given size which are already partly in use.  The tail end of the volume
+ * counts as such a region, as it cannot hold a whole one. */
+static unsigned long pmfs_gap_room(struct pmfs_blocknode *i, int region)
+{
+	unsigned long size = pmfs_region_blocks(region);
+	unsigned long low = i->block_high + 1, end = low + i->gap;
+	unsigned long room = 0;
+
+	if (!i->gap)
+		return 0;
+	if (low & (size - 1))
+		room = min(end, ALIGN(low, size)) - low;
+	if (end & (size - 1))
+		room = max(room, end - max(low, end & ~(size - 1)));
+	return room;
+}
+
+/* Free blocks of the gap after i from its first boundary of a region of the
+ * given size on, i.e. the longest run aligned to that size that fits */
+static unsigned long pmfs_gap_aligned(struct pmfs_blocknode *i, int region)
+{
+	unsigned long size = pmfs_region_blocks(region);
+	unsigned long low = ALIGN(i->block_high + 1, size);
+	unsigned long end = i->block_high + 1 + i->gap;
+
+	return end > low ? end - low : 0;
+}
+
+/* Number of whole aligned regions of the given size in the gap after i */
+static unsigned long pmfs_gap_free_regions(struct pmfs_blocknode *i,
+	int region)
+{
+	unsigned long size = pmfs_region_blocks(region);
+	unsigned long low = ALIGN(i->block_high + 1, size);
+	unsigned long end = (i->block_high + 1 + i->gap) & ~(size - 1);
+
+	return end > low ? (end - low) / size : 0;
+}
+
+/* Recomputes the free gap following i after i->block_high or the next
+ * node's block_low changed. */
+static void pmfs_update_gap(struct super_block *sb, struct pmfs_blocknode *i)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_blocknode *next_i;
+	unsigned long next_block_low, nr_free;
+	int r;
+
+	next_i = pmfs_next_blocknode(i, &sbi->block_inuse_head);
+	next_block_low = next_i ? next_i->block_low : sbi->block_end;
+	i->gap = next_block_low - i->block_high - 1;
+	for (r = 0; r < PMFS_NR_REGIONS; r++) {
+		i->room[r] = pmfs_gap_room(i, r);
+		i->aligned[r] = pmfs_gap_aligned(i, r);
+		nr_free = pmfs_gap_free_regions(i, r);
+		sbi->num_free_regions[r] += nr_free - i->nr_free_regions[r];
+		i->nr_free_regions[r] = nr_free;
+	}
+	pmfs_gap_propagate(&i->node, NULL);
+}
+
+/* Caller must hold the super_block lock.  Links i into the map after prev,
+ * or at the front if prev is NULL. */
+void pmfs_insert_blocknode(struct super_block *sb, struct pmfs_blocknode *i,
+	struct pmfs_blocknode *prev)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct rb_node **link = &sbi->block_inuse_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct pmfs_blocknode *curr;
+
+	list_add(&i->link, prev ? &prev->link : &sbi->block_inuse_head);
+
+	while (*link) {
+		parent = *link;
+		curr = rb_entry(parent, struct pmfs_blocknode, node);
+		if (i->block_low < curr->block_low)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	i->gap = i->subtree_gap = 0;
+	memset(i->room, 0, sizeof(i->room));
+	memset(i->subtree_room, 0, sizeof(i->subtree_room));
+	memset(i->aligned, 0, sizeof(i->aligned));
+	memset(i->subtree_aligned, 0, sizeof(i->subtree_aligned));
+	memset(i->nr_free_regions, 0, sizeof(i->nr_free_regions));
+	rb_link_node(&i->node, parent, link);
+	rb_insert_augmented(&i->node, &sbi->block_inuse_tree,
+			    &pmfs_gap_callbacks);
+
+	pmfs_update_gap(sb, i);
+	if (prev)
+		pmfs_update_gap(sb, prev);
+}
+
+/* Caller must hold the super_block lock. */
+static void pmfs_erase_blocknode(struct super_block *sb,
+	struct pmfs_blocknode *i)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_blocknode *prev;
+	int r;
+
+	for (r = 0; r < PMFS_NR_REGIONS; r++)
+		sbi->num_free_regions[r] -= i->nr_free_regions[r];
+	prev = pmfs_prev_blocknode(i, &sbi->block_inuse_head);
+	rb_erase_augmented(&i->node, &sbi->block_inuse_tree,
+			   &pmfs_gap_callbacks);
+	list_del(&i->link);
+	if (prev)
+		pmfs_update_gap(sb, prev);
+}
+
+/* Returns the blocknode with the greatest block_low <= blocknr */
+static struct pmfs_blocknode *pmfs_search_blocknode(struct pmfs_sb_info *sbi,
+	unsigned long blocknr)
+{
+	struct rb_node *n = sbi->block_inuse_tree.rb_node;
+	struct pmfs_blocknode *i, *found = NULL;
+
+	while (n) {
+		i = rb_entry(n, struct pmfs_blocknode, node);
+		if (blocknr < i->block_low) {
+			n = n->rb_left;
+		} else {
+			found = i;
+			n = n->rb_right;
+		}
+	}
+	return found;
+}
+
+/* Checks whether size blocks aligned to align fit in the gap after i.  With
+ * region < 0 the whole gap may be used; otherwise the run must stay within
+ * the partly used regions of that size at the edges of the gap, and is
+ * placed next to the in-use blocks there. */
+static bool pmfs_gap_fits(struct pmfs_blocknode *i, unsigned long size,
+	unsigned long align, int region, unsigned long *start)
+{
+	unsigned long low = i->block_high + 1, end = low + i->gap;
+	unsigned long rsize, new_block_low;
+
+	if (region < 0) {
+		new_block_low = ALIGN(low, align);
+		*start = new_block_low;
+		return new_block_low + size <= end;
+	}
+
+	rsize = pmfs_region_blocks(region);
+	if (low & (rsize - 1)) {
+		new_block_low = ALIGN(low, align);
+		if (new_block_low + size <= min(end, ALIGN(low, rsize))) {
+			*start = new_block_low;
+			return true;
+		}
+	}
+	if ((end & (rsize - 1)) && end >= size) {
+		new_block_low = (end - size) & ~(align - 1);
+		if (new_block_low >= max(low, end & ~(rsize - 1))) {
+			*start = new_block_low;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Upper bound on the run of size blocks aligned to align that the subtree
+ * of n can hold.  align is 1 or the size of a 2M or 1G region, and for
+ * region < 0 the bound is exact. */
+static unsigned long pmfs_subtree_fit(struct rb_node *n, unsigned long align,
+	int region)
+{
+	struct pmfs_blocknode *i = rb_entry(n, struct pmfs_blocknode, node);
+	unsigned long fit;
+	int r;
+
+	fit = region < 0 ? i->subtree_gap : i->subtree_room[region];
+	for (r = 0; r < PMFS_NR_REGIONS; r++)
+		if (align == pmfs_region_blocks(r))
+			fit = min(fit, i->subtree_aligned[r]);
+	return fit;
+}
+
+/* Finds the leftmost blocknode followed by a gap where size blocks aligned
+ * to align fit, as decided by pmfs_gap_fits().  Subtrees that cannot hold
+ * the run are skipped, so when the bound is exact the walk only descends
+ * and takes O(log n) steps. */
+static struct pmfs_blocknode *__pmfs_find_free_gap(struct rb_node *root,
+	unsigned long size, unsigned long align, int region,
+	unsigned long *start)
+{
+	struct rb_node *n = root, *prev;
+	struct pmfs_blocknode *i;
+	bool descend = true;
+
+	if (!n || pmfs_subtree_fit(n, align, region) < size)
+		return NULL;
+	while (n) {
+		if (descend && n->rb_left &&
+		    pmfs_subtree_fit(n->rb_left, align, region) >= size) {
+			n = n->rb_left;
+			continue;
+		}
+		i = rb_entry(n, struct pmfs_blocknode, node);
+		if (pmfs_gap_fits(i, size, align, region, start))
+			return i;
+		if (n->rb_right &&
+		    pmfs_subtree_fit(n->rb_right, align, region) >= size) {
+			n = n->rb_right;
+			descend = true;
+			continue;
+		}
+		/* nothing fits below n: go back up to the first ancestor
+		 * whose left subtree we came from */
+		do {
+			prev = n;
+			n = rb_parent(n);
+		} while (n && prev == n->rb_right);
+		descend = false;
+	}
+	return NULL;
+}
+
 void pmfs_init_blockmap(struct super_block *sb, unsigned long init_used_size)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
@@ -38,249 +378,903 @@ void pmfs_init_blockmap(struct super_block *sb, unsigned long init_used_size)
 	blknode->block_low = sbi->block_start;
 	blknode->block_high = sbi->block_start + num_used_block - 1;
 	sbi->num_free_blocks -= num_used_block;
-	list_add(&blknode->link, &sbi->block_inuse_head);
+	pmfs_insert_blocknode(sb, blknode, NULL);
 }
 
-static struct pmfs_blocknode *pmfs_next_blocknode(struct pmfs_blocknode *i,
-						  struct list_head *head)
-{
-	if (list_is_last(&i->link, head))
-		return NULL;
-	return list_first_entry(&i->link, typeof(*i), link);
-}
-
-/* Caller must hold the super_block lock.  If start_hint is provided, it is
- * only valid until the caller releases the super_block lock. */
-void __pmfs_free_block(struct super_block *sb, unsigned long blocknr,
-		      unsigned short btype, struct pmfs_blocknode **start_hint)
+/* Caller must hold the super_block lock.  Frees the range [blocknr,
+ * blocknr + num_blocks), which must lie within a single blocknode.  If
+ * start_hint is provided, it is only valid until the caller releases the
+ * super_block lock. */
+static void __pmfs_free_blocks(struct super_block *sb, unsigned long blocknr,
+			       unsigned long num_blocks,
+			       struct pmfs_blocknode **start_hint)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
 	struct list_head *head = &(sbi->block_inuse_head);
 	unsigned long new_block_low;
 	unsigned long new_block_high;
-	unsigned long num_blocks = 0;
 	struct pmfs_blocknode *i;
-	struct pmfs_blocknode *free_blocknode= NULL;
 	struct pmfs_blocknode *curr_node;
 
-	num_blocks = pmfs_get_numblocks(btype);
 	new_block_low = blocknr;
 	new_block_high = blocknr + num_blocks - 1;
 
 	BUG_ON(list_empty(head));
 
 	if (start_hint && *start_hint &&
-	    new_block_low >= (*start_hint)->block_low)
+	    new_block_low >= (*start_hint)->block_low &&
+	    new_block_high <= (*start_hint)->block_high)
 		i = *start_hint;
 	else
-		i = list_first_entry(head, typeof(*i), link);
+		i = pmfs_search_blocknode(sbi, new_block_low);
+
+	if (!i || new_block_high > i->block_high)
+		goto not_found;
+
+	if ((new_block_low == i->block_low) &&
+		(new_block_high == i->block_high)) {
+		/* fits entire datablock */
+		if (start_hint)
+			*start_hint = pmfs_next_blocknode(i, head);
+		pmfs_erase_blocknode(sb, i);
+		__pmfs_free_blocknode(i);
+		sbi->num_blocknode_allocated--;
+		sbi->num_free_blocks += num_blocks;
+		return;
+	}
+	if ((new_block_low == i->block_low) &&
+		(new_block_high < i->block_high)) {
+		/* Aligns left */
+		struct pmfs_blocknode *prev = pmfs_prev_blocknode(i, head);
 
-	list_for_each_entry_from(i, head, link) {
+		i->block_low = new_block_high + 1;
+		if (prev)
+			pmfs_update_gap(sb, prev);
+		sbi->num_free_blocks += num_blocks;
+		if (start_hint)
+			*start_hint = i;
+		return;
+	}
+	if ((new_block_low > i->block_low) && 
+		(new_block_high == i->block_high)) {
+		/* Aligns right */
+		i->block_high = new_block_low - 1;
+		pmfs_update_gap(sb, i);
+		sbi->num_free_blocks += num_blocks;
+		if (start_hint)
+			*start_hint = pmfs_next_blocknode(i, head);
+		return;
+	}
+	if ((new_block_low > i->block_low) &&
+		(new_block_high < i->block_high)) {
+		/* Aligns somewhere in the middle */
+		curr_node = pmfs_alloc_blocknode(sb);
+		PMFS_ASSERT(curr_node);
+		if (curr_node == NULL) {
+			/* returning without freeing the block*/
+			return;
+		}
+		curr_node->block_low = new_block_high + 1;
+		curr_node->block_high = i->block_high;
+		i->block_high = new_block_low - 1;
+		pmfs_insert_blocknode(sb, curr_node, i);
+		sbi->num_free_blocks += num_blocks;
+		if (start_hint)
+			*start_hint = curr_node;
+		return;
+	}
 
-		if (new_block_low > i->block_high) {
-			/* skip to next blocknode */
+not_found:
+	pmfs_error_mng(sb, "Unable to free block %ld\n", blocknr);
+}
+
+/* Caller must hold the super_block lock.  If start_hint is provided, it is
+ * only valid until the caller releases the super_block lock. */
+void __pmfs_free_block(struct super_block *sb, unsigned long blocknr,
+		      unsigned short btype, struct pmfs_blocknode **start_hint)
+{
+	__pmfs_free_blocks(sb, blocknr, pmfs_get_numblocks(btype), start_hint);
+}
+
+/* Caller must hold the super_block lock.  Marks [new_block_low,
+ * new_block_high], which must lie within the free gap following i, as in
+ * use. */
+static int __pmfs_fill_gap(struct super_block *sb, struct pmfs_blocknode *i,
+	unsigned long new_block_low, unsigned long new_block_high)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_blocknode *next_i;
+	struct pmfs_blocknode *curr_node;
+	unsigned long next_block_low;
+
+	next_i = pmfs_next_blocknode(i, &sbi->block_inuse_head);
+	next_block_low = next_i ? next_i->block_low : sbi->block_end;
+
+	if ((new_block_low == (i->block_high + 1)) &&
+		(new_block_high == (next_block_low - 1)))
+	{
+		/* Fill the gap completely */
+		if (next_i) {
+			i->block_high = next_i->block_high;
+			pmfs_erase_blocknode(sb, next_i);
+			pmfs_free_blocknode(sb, next_i);
+		} else {
+			i->block_high = new_block_high;
+		}
+		pmfs_update_gap(sb, i);
+	} else if ((new_block_low == (i->block_high + 1)) &&
+		(new_block_high < (next_block_low - 1))) {
+		/* Aligns to left */
+		i->block_high = new_block_high;
+		pmfs_update_gap(sb, i);
+	} else if ((new_block_low > (i->block_high + 1)) &&
+		(new_block_high == (next_block_low - 1)) && next_i) {
+		/* Aligns to right and the right node exists */
+		next_i->block_low = new_block_low;
+		pmfs_update_gap(sb, i);
+	} else {
+		/* Aligns somewhere in the middle or at the end of the map */
+		curr_node = pmfs_alloc_blocknode(sb);
+		PMFS_ASSERT(curr_node);
+		if (curr_node == NULL)
+			return -ENOSPC;
+		curr_node->block_low = new_block_low;
+		curr_node->block_high = new_block_high;
+		pmfs_insert_blocknode(sb, curr_node, i);
+	}
+
+	sbi->num_free_blocks -= new_block_high - new_block_low + 1;
+	return 0;
+}
+
+/* Caller must hold the super_block lock.  Marks an arbitrary free range as
+ * in use, e.g. while rebuilding the map from a full scan. */
+int __pmfs_reserve_blocks(struct super_block *sb, unsigned long low,
+	unsigned long high)
+{
+	struct pmfs_blocknode *i;
+
+	i = pmfs_search_blocknode(PMFS_SB(sb), low);
+	if (!i || low <= i->block_high || high > i->block_high + i->gap)
+		return -ENOSPC;
+	return __pmfs_fill_gap(sb, i, low, high);
+}
+
+/* Caller must hold the super_block lock.  Allocates up to num contiguous
+ * units of num_blocks blocks, each aligned to num_blocks.  The run is first
+ * looked for in the partly used 2M and then 1G regions larger than the
+ * unit, then in the first gap that can hold all of it, and otherwise the
+ * longest aligned run available is taken.  With partial set, any room in a
+ * partly used region is taken before breaking up a free one, even if it is
+ * shorter than num.  Returns the number of units allocated. */
+static unsigned long __pmfs_new_blocks(struct super_block *sb,
+	unsigned long num, unsigned long num_blocks, bool partial,
+	unsigned long *blocknr)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct rb_node *root = sbi->block_inuse_tree.rb_node;
+	struct pmfs_blocknode *i = NULL;
+	unsigned long new_block_low, max_gap, room;
+	int region;
+
+	if (!root)
+		return 0;
+	max_gap = rb_entry(root, struct pmfs_blocknode, node)->subtree_gap;
+	num = min(num, max_gap / num_blocks);
+	if (!num)
+		return 0;
+
+	for (region = 0; region < PMFS_NR_REGIONS; region++) {
+		if (pmfs_region_blocks(region) <= num_blocks)
+			continue;
+		i = __pmfs_find_free_gap(root, num * num_blocks, num_blocks,
+					 region, &new_block_low);
+		if (i)
+			goto found;
+		if (!partial)
 			continue;
+		room = rb_entry(root, struct pmfs_blocknode,
+				node)->subtree_room[region] / num_blocks;
+		room = min(room, num);
+		for (; room; room--) {
+			i = __pmfs_find_free_gap(root, room * num_blocks,
+					num_blocks, region, &new_block_low);
+			if (i) {
+				num = room;
+				goto found;
+			}
 		}
+	}
+
+	/* alignment can waste up to num_blocks - 1 blocks of the largest
+	 * gap, so this loop runs at most twice once num is clamped */
+	for (; num; num--) {
+		i = __pmfs_find_free_gap(root, num * num_blocks, num_blocks,
+					 -1, &new_block_low);
+		if (i)
+			break;
+	}
+	if (!num)
+		return 0;
 
-		if ((new_block_low == i->block_low) &&
-			(new_block_high == i->block_high)) {
-			/* fits entire datablock */
-			if (start_hint)
-				*start_hint = pmfs_next_blocknode(i, head);
-			list_del(&i->link);
-			free_blocknode = i;
-			sbi->num_blocknode_allocated--;
-			sbi->num_free_blocks += num_blocks;
-			goto block_found;
+found:
+	if (__pmfs_fill_gap(sb, i, new_block_low,
+			    new_block_low + num * num_blocks - 1))
+		return 0;
+	*blocknr = new_block_low;
+	return num;
+}
+
+/* Caller must hold the super_block lock.  Allocates up to num contiguous
+ * units of num_blocks blocks starting exactly at goal, if goal is free and
+ * aligned to num_blocks.  Returns the number of units allocated. */
+static unsigned long __pmfs_new_blocks_at(struct super_block *sb,
+	unsigned long goal, unsigned long num, unsigned long num_blocks,
+	unsigned long *blocknr)
+{
+	struct pmfs_blocknode *i;
+	unsigned long room;
+
+	if (goal & (num_blocks - 1))
+		return 0;
+	i = pmfs_search_blocknode(PMFS_SB(sb), goal);
+	if (!i || goal <= i->block_high || goal > i->block_high + i->gap)
+		return 0;
+	room = (i->block_high + i->gap - goal + 1) / num_blocks;
+	num = min(num, room);
+	if (!num || __pmfs_fill_gap(sb, i, goal, goal + num * num_blocks - 1))
+		return 0;
+	*blocknr = goal;
+	return num;
+}
+
+static int pmfs_cmp_blocknr(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return x < y ? -1 : (x > y);
+}
+
+/* Returns a batch of single 4K blocks to the global free space */
+static void pmfs_free_block_batch(struct super_block *sb,
+	unsigned long *blocks, unsigned int num)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_blocknode *start_hint = NULL;
+	unsigned int i;
+
+	/* sorted frees let the start hint skip most of the list walk */
+	sort(blocks, num, sizeof(*blocks), pmfs_cmp_blocknr, NULL);
+	mutex_lock(&sbi->s_lock);
+	for (i = 0; i < num; i++)
+		__pmfs_free_blocks(sb, blocks[i], 1, &start_hint);
+	mutex_unlock(&sbi->s_lock);
+}
+
+/* Returns the extents gathered in batch to the block map, in block order
+ * and merged where they touch, then lets other allocations in */
+void pmfs_free_batch_flush(struct super_block *sb,
+	struct pmfs_free_batch *batch)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_blocknode *start_hint = NULL;
+	struct pmfs_extent *ext = batch->ext;
+	unsigned int i, nr = 0;
+	u64 start;
+
+	if (!batch->nr)
+		return;
+	start = local_clock();
+	/* blocknr is the first field, so extents sort like block numbers */
+	sort(ext, batch->nr, sizeof(*ext), pmfs_cmp_blocknr, NULL);
+	for (i = 1; i < batch->nr; i++) {
+		if (ext[nr].blocknr + ext[nr].num == ext[i].blocknr)
+			ext[nr].num += ext[i].num;
+		else
+			ext[++nr] = ext[i];
+	}
+	nr++;
+
+	mutex_lock(&sbi->s_lock);
+	for (i = 0; i < nr; i++)
+		__pmfs_free_blocks(sb, ext[i].blocknr, ext[i].num, &start_hint);
+	mutex_unlock(&sbi->s_lock);
+	pmfs_record_latency(sb, PMFS_LAT_FREE_BLOCK, start);
+	batch->nr = 0;
+	cond_resched();
+}
+
+/* Queues num blocks starting at blocknr to be freed with the next flush of
+ * batch.  Blocks that continue the last queued extent are merged into it. */
+void pmfs_free_batch_add(struct super_block *sb,
+	struct pmfs_free_batch *batch, unsigned long blocknr,
+	unsigned long num)
+{
+	struct pmfs_extent *ext;
+
+	if (batch->nr) {
+		ext = &batch->ext[batch->nr - 1];
+		if (ext->blocknr + ext->num == blocknr) {
+			ext->num += num;
+			return;
 		}
-		if ((new_block_low == i->block_low) &&
-			(new_block_high < i->block_high)) {
-			/* Aligns left */
-			i->block_low = new_block_high + 1;
-			sbi->num_free_blocks += num_blocks;
-			if (start_hint)
-				*start_hint = i;
-			goto block_found;
+		if (blocknr + num == ext->blocknr) {
+			ext->blocknr = blocknr;
+			ext->num += num;
+			return;
 		}
-		if ((new_block_low > i->block_low) && 
-			(new_block_high == i->block_high)) {
-			/* Aligns right */
-			i->block_high = new_block_low - 1;
-			sbi->num_free_blocks += num_blocks;
-			if (start_hint)
-				*start_hint = pmfs_next_blocknode(i, head);
-			goto block_found;
+	}
+	if (batch->nr == PMFS_FREE_BATCH)
+		pmfs_free_batch_flush(sb, batch);
+	ext = &batch->ext[batch->nr++];
+	ext->blocknr = blocknr;
+	ext->num = num;
+}
+
+static bool pmfs_pool_get(struct pmfs_free_pool *pool, unsigned long *blocknr)
+{
+	if (pool->ext_low < pool->ext_end) {
+		*blocknr = pool->ext_low++;
+		return true;
+	}
+	if (pool->nr_freed) {
+		*blocknr = pool->freed[--pool->nr_freed];
+		return true;
+	}
+	return false;
+}
+
+static int pmfs_pool_new_block(struct super_block *sb, unsigned long *blocknr)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_free_pool *pool;
+	unsigned long low, num;
+	bool found;
+
+	pool = get_cpu_ptr(sbi->free_pools);
+	spin_lock(&pool->lock);
+	found = pmfs_pool_get(pool, blocknr);
+	spin_unlock(&pool->lock);
+	put_cpu_ptr(sbi->free_pools);
+	if (found)
+		return 0;
+
+	/* Pool is empty, carve a new extent out of the global free space */
+	mutex_lock(&sbi->s_lock);
+	num = __pmfs_new_blocks(sb, PMFS_POOL_BATCH, 1, true, &low);
+	mutex_unlock(&sbi->s_lock);
+	if (num == 0) {
+		/* the remaining free blocks may be cached by other CPUs */
+		pmfs_drain_free_pools(sb);
+		mutex_lock(&sbi->s_lock);
+		num = __pmfs_new_blocks(sb, 1, 1, false, &low);
+		mutex_unlock(&sbi->s_lock);
+		if (num == 0)
+			return -ENOSPC;
+	}
+	*blocknr = low++;
+	if (--num == 0)
+		return 0;
+
+	pool = get_cpu_ptr(sbi->free_pools);
+	spin_lock(&pool->lock);
+	if (pool->ext_low == pool->ext_end) {
+		pool->ext_low = low;
+		pool->ext_end = low + num;
+		num = 0;
+	}
+	spin_unlock(&pool->lock);
+	put_cpu_ptr(sbi->free_pools);
+
+	if (num) {
+		/* Raced with another refill of this pool, give the rest back */
+		mutex_lock(&sbi->s_lock);
+		__pmfs_free_blocks(sb, low, num, NULL);
+		mutex_unlock(&sbi->s_lock);
+	}
+	return 0;
+}
+
+static void pmfs_pool_free_block(struct super_block *sb, unsigned long blocknr)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_free_pool *pool;
+	unsigned long batch[PMFS_POOL_BATCH];
+	unsigned int num = 0;
+
+	pool = get_cpu_ptr(sbi->free_pools);
+	spin_lock(&pool->lock);
+	if (pool->ext_low == pool->ext_end) {
+		pool->ext_low = blocknr;
+		pool->ext_end = blocknr + 1;
+	} else if (blocknr + 1 == pool->ext_low) {
+		pool->ext_low--;
+	} else {
+		if (pool->nr_freed == PMFS_POOL_MAX_FREED) {
+			/* hand the oldest batch back to the global free space */
+			num = PMFS_POOL_BATCH;
+			memcpy(batch, pool->freed, sizeof(batch));
+			pool->nr_freed -= num;
+			memmove(pool->freed, pool->freed + num,
+				pool->nr_freed * sizeof(pool->freed[0]));
 		}
-		if ((new_block_low > i->block_low) &&
-			(new_block_high < i->block_high)) {
-			/* Aligns somewhere in the middle */
-			curr_node = pmfs_alloc_blocknode(sb);
-			PMFS_ASSERT(curr_node);
-			if (curr_node == NULL) {
-				/* returning without freeing the block*/
-				goto block_found;
-			}
-			curr_node->block_low = new_block_high + 1;
-			curr_node->block_high = i->block_high;
-			i->block_high = new_block_low - 1;
-			list_add(&curr_node->link, &i->link);
-			sbi->num_free_blocks += num_blocks;
-			if (start_hint)
-				*start_hint = curr_node;
-			goto block_found;
+		pool->freed[pool->nr_freed++] = blocknr;
+	}
+	spin_unlock(&pool->lock);
+	put_cpu_ptr(sbi->free_pools);
+
+	if (num)
+		pmfs_free_block_batch(sb, batch, num);
+}
+
+/* Returns the blocks cached in all the per-CPU pools, and the pre-zeroed
+ * blocks, to the global free space. */
+void pmfs_drain_free_pools(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_free_pool *pool;
+	unsigned long freed[PMFS_POOL_MAX_FREED];
+	unsigned long low, num;
+	unsigned int nr_freed;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(sbi->free_pools, cpu);
+		spin_lock(&pool->lock);
+		low = pool->ext_low;
+		num = pool->ext_end - pool->ext_low;
+		pool->ext_low = pool->ext_end = 0;
+		nr_freed = pool->nr_freed;
+		memcpy(freed, pool->freed, nr_freed * sizeof(freed[0]));
+		pool->nr_freed = 0;
+		spin_unlock(&pool->lock);
+
+		if (num) {
+			mutex_lock(&sbi->s_lock);
+			__pmfs_free_blocks(sb, low, num, NULL);
+			mutex_unlock(&sbi->s_lock);
 		}
+		if (nr_freed)
+			pmfs_free_block_batch(sb, freed, nr_freed);
 	}
+	pmfs_drain_zero_pools(sb);
+}
 
-	pmfs_error_mng(sb, "Unable to free block %ld\n", blocknr);
+int pmfs_init_free_pools(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	int cpu;
+
+	sbi->free_pools = alloc_percpu(struct pmfs_free_pool);
+	if (!sbi->free_pools)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(sbi->free_pools, cpu)->lock);
+	for (cpu = 0; cpu < PMFS_NR_ZERO_POOLS; cpu++)
+		spin_lock_init(&sbi->zero_pools[cpu].lock);
+	init_waitqueue_head(&sbi->zero_wait);
+	return 0;
+}
 
-block_found:
+void pmfs_destroy_free_pools(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
 
-	if (free_blocknode)
-		__pmfs_free_blocknode(free_blocknode);
+	if (!sbi->free_pools)
+		return;
+	pmfs_drain_free_pools(sb);
+	free_percpu(sbi->free_pools);
+	sbi->free_pools = NULL;
 }
 
 void pmfs_free_block(struct super_block *sb, unsigned long blocknr,
 		      unsigned short btype)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	u64 start = local_clock();
+
+	if (pmfs_use_free_pool(sb, btype)) {
+		pmfs_pool_free_block(sb, blocknr);
+	} else {
+		mutex_lock(&sbi->s_lock);
+		__pmfs_free_block(sb, blocknr, btype, NULL);
+		mutex_unlock(&sbi->s_lock);
+	}
+	pmfs_record_latency(sb, PMFS_LAT_FREE_BLOCK, start);
+}
+
+/* Frees num contiguous blocks of type btype starting at blocknr */
+void pmfs_free_blocks(struct super_block *sb, unsigned long blocknr,
+	unsigned long num, unsigned short btype)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	u64 start = local_clock();
+
 	mutex_lock(&sbi->s_lock);
-	__pmfs_free_block(sb, blocknr, btype, NULL);
+	__pmfs_free_blocks(sb, blocknr, num * pmfs_get_numblocks(btype), NULL);
 	mutex_unlock(&sbi->s_lock);
+	pmfs_record_latency(sb, PMFS_LAT_FREE_BLOCK, start);
 }
 
-int pmfs_new_block(struct super_block *sb, unsigned long *blocknr,
-	unsigned short btype, int zero)
+/*
+ * Pre-zeroed blocks.  A per-mount thread takes free 4K and 2M blocks out of
+ * the block map, clears them with non-temporal stores and keeps them in
+ * zero_pools[], so that allocations asking for zeroed blocks do not pay
+ * for the memset in their own context.  1G blocks are always zeroed
+ * inline; keeping a spare 1G block around is too expensive.
+ */
+
+/* pool size to refill up to, and allocation size per refill, in blocks of
+ * the pool's type */
+static const unsigned long pmfs_zero_pool_target[PMFS_NR_ZERO_POOLS] = {
+	1024, 8 };
+static const unsigned long pmfs_zero_pool_batch[PMFS_NR_ZERO_POOLS] = {
+	64, 1 };
+
+static inline bool pmfs_zero_pool_low(struct pmfs_zero_pool *pool,
+	unsigned short btype)
+{
+	return pool->nr_blocks < pmfs_zero_pool_target[btype] / 2;
+}
+
+static unsigned long pmfs_zero_pool_get(struct super_block *sb,
+	unsigned short btype, unsigned long num, unsigned long *blocknr)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
-	struct list_head *head = &(sbi->block_inuse_head);
-	struct pmfs_blocknode *i, *next_i;
-	struct pmfs_blocknode *free_blocknode= NULL;
+	struct pmfs_zero_pool *pool = &sbi->zero_pools[btype];
+	struct pmfs_extent *ext;
+	unsigned long allocated = 0;
+	bool low;
+
+	spin_lock(&pool->lock);
+	if (pool->nr_extents) {
+		ext = &pool->ext[pool->nr_extents - 1];
+		allocated = min(num, ext->num);
+		*blocknr = ext->blocknr;
+		ext->blocknr += allocated * pmfs_get_numblocks(btype);
+		ext->num -= allocated;
+		if (!ext->num)
+			pool->nr_extents--;
+		pool->nr_blocks -= allocated;
+	}
+	/* a stalled pool is retried on a timer instead */
+	low = pmfs_zero_pool_low(pool, btype) && !pool->stalled;
+	spin_unlock(&pool->lock);
+
+	/* pairs with the barrier in prepare_to_wait() */
+	smp_mb();
+	if (low && waitqueue_active(&sbi->zero_wait))
+		wake_up_interruptible(&sbi->zero_wait);
+	return allocated;
+}
+
+static void pmfs_refill_zero_pool(struct super_block *sb, unsigned short btype)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_zero_pool *pool = &sbi->zero_pools[btype];
+	unsigned long num_blocks = pmfs_get_numblocks(btype);
+	unsigned long size = blk_type_to_size[btype];
+	unsigned long blocknr, num, j;
 	void *bp;
-	unsigned long num_blocks = 0;
-	struct pmfs_blocknode *curr_node;
-	int errval = 0;
-	bool found = 0;
-	unsigned long next_block_low;
-	unsigned long new_block_low;
-	unsigned long new_block_high;
 
-	num_blocks = pmfs_get_numblocks(btype);
+	pool->stalled = false;
+	while (!kthread_should_stop() &&
+	       pool->nr_blocks < pmfs_zero_pool_target[btype] &&
+	       pool->nr_extents < PMFS_ZERO_POOL_EXTENTS) {
+		/* leave the last free blocks to foreground allocations */
+		if (sbi->num_free_blocks <
+		    4 * pmfs_zero_pool_target[btype] * num_blocks)
+			break;
 
-	mutex_lock(&sbi->s_lock);
+		mutex_lock(&sbi->s_lock);
+		num = __pmfs_new_blocks(sb, pmfs_zero_pool_batch[btype],
+					num_blocks, btype == PMFS_BLOCK_TYPE_4K,
+					&blocknr);
+		mutex_unlock(&sbi->s_lock);
+		if (!num) {
+			/* no free run of this type: fragmented, not full */
+			pool->stalled = true;
+			break;
+		}
 
-	list_for_each_entry(i, head, link) {
-		if (i->link.next == head) {
-			next_i = NULL;
-			next_block_low = sbi->block_end;
-		} else {
-			next_i = list_entry(i->link.next, typeof(*i), link);
-			next_block_low = next_i->block_low;
+		bp = pmfs_get_block(sb, pmfs_get_block_off(sb, blocknr, btype));
+		for (j = 0; j < num; j++) {
+			/* unlocking may disable interrupts, so only reschedule
+			 * with the range locked again */
+			pmfs_memunlock_range(sb, bp + j * size, size);
+			memset_nt(bp + j * size, 0, size);
+			pmfs_memlock_range(sb, bp + j * size, size);
+			cond_resched();
 		}
+		/* the zeroes must be durable before the blocks are handed
+		 * out and linked into a file */
+		PERSISTENT_MARK();
+		PERSISTENT_BARRIER();
+
+		spin_lock(&pool->lock);
+		pool->ext[pool->nr_extents].blocknr = blocknr;
+		pool->ext[pool->nr_extents].num = num;
+		pool->nr_extents++;
+		pool->nr_blocks += num;
+		spin_unlock(&pool->lock);
+	}
+}
 
-		new_block_low = (i->block_high + num_blocks) & ~(num_blocks - 1);
-		new_block_high = new_block_low + num_blocks - 1;
+/* Returns the pre-zeroed blocks to the global free space */
+void pmfs_drain_zero_pools(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_extent ext[PMFS_ZERO_POOL_EXTENTS];
+	struct pmfs_zero_pool *pool;
+	unsigned int nr_extents, j;
+	unsigned short btype;
 
-		if (new_block_high >= next_block_low) {
-			/* Does not fit - skip to next blocknode */
+	for (btype = 0; btype < PMFS_NR_ZERO_POOLS; btype++) {
+		pool = &sbi->zero_pools[btype];
+		spin_lock(&pool->lock);
+		nr_extents = pool->nr_extents;
+		memcpy(ext, pool->ext, nr_extents * sizeof(ext[0]));
+		pool->nr_extents = 0;
+		pool->nr_blocks = 0;
+		spin_unlock(&pool->lock);
+
+		if (!nr_extents)
 			continue;
-		}
+		mutex_lock(&sbi->s_lock);
+		for (j = 0; j < nr_extents; j++)
+			__pmfs_free_blocks(sb, ext[j].blocknr, ext[j].num *
+					   pmfs_get_numblocks(btype), NULL);
+		mutex_unlock(&sbi->s_lock);
+	}
+}
 
-		if ((new_block_low == (i->block_high + 1)) &&
-			(new_block_high == (next_block_low - 1)))
-		{
-			/* Fill the gap completely */
-			if (next_i) {
-				i->block_high = next_i->block_high;
-				list_del(&next_i->link);
-				free_blocknode = next_i;
-				sbi->num_blocknode_allocated--;
-			} else {
-				i->block_high = new_block_high;
-			}
-			found = 1;
-			break;
-		}
+/* true if some pool is below its watermark and pmfs_refill_zero_pool()
+ * could add to it. A stalled pool is left to the retry timer. */
+static bool pmfs_zero_pools_need_refill(struct pmfs_sb_info *sbi,
+	bool *stalled)
+{
+	struct pmfs_zero_pool *pool;
+	unsigned short btype;
 
-		if ((new_block_low == (i->block_high + 1)) &&
-			(new_block_high < (next_block_low - 1))) {
-			/* Aligns to left */
-			i->block_high = new_block_high;
-			found = 1;
-			break;
+	*stalled = false;
+	for (btype = 0; btype < PMFS_NR_ZERO_POOLS; btype++) {
+		pool = &sbi->zero_pools[btype];
+		if (pool->stalled) {
+			*stalled = true;
+			continue;
 		}
+		if (pmfs_zero_pool_low(pool, btype) &&
+		    pool->nr_extents < PMFS_ZERO_POOL_EXTENTS &&
+		    sbi->num_free_blocks >= 4 * pmfs_zero_pool_target[btype] *
+		    pmfs_get_numblocks(btype))
+			return true;
+	}
+	return false;
+}
 
-		if ((new_block_low > (i->block_high + 1)) &&
-			(new_block_high == (next_block_low - 1))) {
-			/* Aligns to right */
-			if (next_i) {
-				/* right node exist */
-				next_i->block_low = new_block_low;
-			} else {
-				/* right node does NOT exist */
-				curr_node = pmfs_alloc_blocknode(sb);
-				PMFS_ASSERT(curr_node);
-				if (curr_node == NULL) {
-					errval = -ENOSPC;
-					break;
-				}
-				curr_node->block_low = new_block_low;
-				curr_node->block_high = new_block_high;
-				list_add(&curr_node->link, &i->link);
-			}
-			found = 1;
-			break;
-		}
+/* The condition is checked again after prepare_to_wait(), so a wakeup sent
+ * while the pools were being refilled is not lost. Frees can make a free
+ * run again, so a stalled pool is retried after PMFS_ZERO_RETRY_DELAY. */
+static void pmfs_zero_thread_try_sleeping(struct pmfs_sb_info *sbi)
+{
+	bool stalled;
+	DEFINE_WAIT(wait);
 
-		if ((new_block_low > (i->block_high + 1)) &&
-			(new_block_high < (next_block_low - 1))) {
-			/* Aligns somewhere in the middle */
-			curr_node = pmfs_alloc_blocknode(sb);
-			PMFS_ASSERT(curr_node);
-			if (curr_node == NULL) {
-				errval = -ENOSPC;
-				break;
-			}
-			curr_node->block_low = new_block_low;
-			curr_node->block_high = new_block_high;
-			list_add(&curr_node->link, &i->link);
-			found = 1;
+	prepare_to_wait(&sbi->zero_wait, &wait, TASK_INTERRUPTIBLE);
+	if (!kthread_should_stop() &&
+	    !pmfs_zero_pools_need_refill(sbi, &stalled))
+		schedule_timeout(stalled ? PMFS_ZERO_RETRY_DELAY :
+				 MAX_SCHEDULE_TIMEOUT);
+	finish_wait(&sbi->zero_wait, &wait);
+}
+
+static int pmfs_zero_thread(void *arg)
+{
+	struct super_block *sb = (struct super_block *)arg;
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	unsigned short btype;
+
+	pmfs_dbg_verbose("Running block zeroing thread\n");
+	for ( ; ; ) {
+		for (btype = 0; btype < PMFS_NR_ZERO_POOLS; btype++)
+			pmfs_refill_zero_pool(sb, btype);
+		cond_resched();
+
+		pmfs_zero_thread_try_sleeping(sbi);
+
+		if (kthread_should_stop())
 			break;
-		}
 	}
-	
-	if (found == 1) {
-		sbi->num_free_blocks -= num_blocks;
-	}	
+	pmfs_dbg_verbose("Exiting block zeroing thread\n");
+	return 0;
+}
 
-	mutex_unlock(&sbi->s_lock);
+void pmfs_start_zero_thread(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
 
-	if (free_blocknode)
-		__pmfs_free_blocknode(free_blocknode);
+	if (sbi->zero_thread)
+		return;
+	sbi->zero_thread = kthread_run(pmfs_zero_thread, sb,
+			"pmfs_zero_0x%llx", (u64)sbi->phys_addr);
+	if (IS_ERR(sbi->zero_thread)) {
+		/* not fatal, zeroed blocks are then cleared inline */
+		pmfs_warn("Failed to start pmfs block zeroing thread\n");
+		sbi->zero_thread = NULL;
+	}
+}
 
-	if (found == 0) {
-		return -ENOSPC;
+void pmfs_stop_zero_thread(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+
+	if (!sbi->zero_thread)
+		return;
+	kthread_stop(sbi->zero_thread);
+	sbi->zero_thread = NULL;
+	pmfs_drain_zero_pools(sb);
+}
+
+/* Takes num blocks from the start of this CPU's cached extent if it holds
+ * that many, or with a goal, up to num blocks if the extent starts at goal.
+ * Returns the number of blocks taken. */
+static unsigned long pmfs_pool_new_run(struct super_block *sb,
+	unsigned long num, unsigned long goal, unsigned long *blocknr)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_free_pool *pool;
+	unsigned long found = 0;
+
+	pool = get_cpu_ptr(sbi->free_pools);
+	spin_lock(&pool->lock);
+	if (goal) {
+		/* any part of the extent is worth taking if it continues
+		 * the caller's run */
+		if (pool->ext_low == goal)
+			found = min(num, pool->ext_end - pool->ext_low);
+	} else if (pool->ext_end - pool->ext_low >= num) {
+		found = num;
 	}
+	*blocknr = pool->ext_low;
+	pool->ext_low += found;
+	spin_unlock(&pool->lock);
+	put_cpu_ptr(sbi->free_pools);
+	return found;
+}
 
-	if (zero) {
-		size_t size;
-		bp = pmfs_get_block(sb, pmfs_get_block_off(sb, new_block_low, btype));
-		pmfs_memunlock_block(sb, bp); //TBDTBD: Need to fix this
-		if (btype == PMFS_BLOCK_TYPE_4K)
-			size = 0x1 << 12;
-		else if (btype == PMFS_BLOCK_TYPE_2M)
-			size = 0x1 << 21;
-		else
-			size = 0x1 << 30;
-		memset_nt(bp, 0, size);
-		pmfs_memlock_block(sb, bp);
+/* Zeroes num contiguous blocks of type btype starting at blocknr */
+void pmfs_zero_blocks(struct super_block *sb, unsigned long blocknr,
+	unsigned long num, unsigned short btype)
+{
+	size_t size;
+	unsigned long j;
+	void *bp;
+
+	bp = pmfs_get_block(sb, pmfs_get_block_off(sb, blocknr, btype));
+	if (btype == PMFS_BLOCK_TYPE_4K)
+		size = 0x1 << 12;
+	else if (btype == PMFS_BLOCK_TYPE_2M)
+		size = 0x1 << 21;
+	else
+		size = 0x1 << 30;
+	pmfs_memunlock_range(sb, bp, num * size);
+	/* memset_nt takes a 32-bit length, so zero a block at a time */
+	for (j = 0; j < num; j++)
+		memset_nt(bp + j * size, 0, size);
+	pmfs_memlock_range(sb, bp, num * size);
+}
+
+/*
+ * Allocates up to num contiguous blocks of type btype, zeroing them if
+ * asked.  If goal is non-zero, the blocks starting at goal are preferred,
+ * typically the ones right after the caller's previous allocation, and
+ * first fit is used only if goal is not free.  Returns the number of blocks
+ * allocated, which is the longest contiguous run available when num blocks
+ * are not free in one piece, or a negative error.
+ */
+int pmfs_new_blocks(struct super_block *sb, unsigned long *blocknr,
+	unsigned int num, unsigned short btype, int zero, unsigned long goal)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	unsigned long num_blocks = 0;
+	unsigned long new_block_low;
+	unsigned long allocated = 0;
+	u64 start = local_clock();
+	int errval;
+
+	num_blocks = pmfs_get_numblocks(btype);
+
+	if (goal) {
+		if (pmfs_use_free_pool(sb, btype))
+			allocated = pmfs_pool_new_run(sb, num, goal,
+						      &new_block_low);
+		if (!allocated) {
+			mutex_lock(&sbi->s_lock);
+			allocated = __pmfs_new_blocks_at(sb, goal, num,
+							 num_blocks,
+							 &new_block_low);
+			mutex_unlock(&sbi->s_lock);
+		}
+	}
+
+	if (!allocated && zero && btype < PMFS_NR_ZERO_POOLS &&
+	    sbi->zero_thread) {
+		allocated = pmfs_zero_pool_get(sb, btype, num, &new_block_low);
+		if (allocated) {
+			*blocknr = new_block_low;
+			errval = allocated;
+			goto out;
+		}
+	}
+
+	if (allocated) {
+		/* served at goal */
+	} else if (pmfs_use_free_pool(sb, btype) && num == 1) {
+		errval = pmfs_pool_new_block(sb, &new_block_low);
+		if (errval)
+			goto out;
+		allocated = 1;
+	} else if (pmfs_use_free_pool(sb, btype) &&
+		   pmfs_pool_new_run(sb, num, 0, &new_block_low)) {
+		allocated = num;
+	} else {
+		mutex_lock(&sbi->s_lock);
+		allocated = __pmfs_new_blocks(sb, num, num_blocks, false,
+					      &new_block_low);
+		mutex_unlock(&sbi->s_lock);
+		if (allocated == 0 && sbi->free_pools &&
+		    !pmfs_is_mounting(sb)) {
+			pmfs_drain_free_pools(sb);
+			mutex_lock(&sbi->s_lock);
+			allocated = __pmfs_new_blocks(sb, num, num_blocks,
+						      false, &new_block_low);
+			mutex_unlock(&sbi->s_lock);
+		}
+		if (allocated == 0) {
+			errval = -ENOSPC;
+			goto out;
+		}
 	}
-	*blocknr = new_block_low;
 
+	if (zero)
+		pmfs_zero_blocks(sb, new_block_low, allocated, btype);
+	*blocknr = new_block_low;
+	errval = allocated;
+out:
+	pmfs_record_latency(sb, PMFS_LAT_NEW_BLOCK, start);
 	return errval;
 }
 
+int pmfs_new_block(struct super_block *sb, unsigned long *blocknr,
+	unsigned short btype, int zero)
+{
+	int allocated = pmfs_new_blocks(sb, blocknr, 1, btype, zero, 0);
+
+	return allocated < 0 ? allocated : 0;
+}
+
 unsigned long pmfs_count_free_blocks(struct super_block *sb)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
-	return sbi->num_free_blocks; 
+	struct pmfs_free_pool *pool;
+	unsigned long num_free = sbi->num_free_blocks;
+	unsigned short btype;
+	int cpu;
+
+	/* preallocated blocks are still free as far as users can tell */
+	num_free += sbi->num_prealloc_blocks;
+
+	for (btype = 0; btype < PMFS_NR_ZERO_POOLS; btype++)
+		num_free += sbi->zero_pools[btype].nr_blocks *
+			pmfs_get_numblocks(btype);
+	if (!sbi->free_pools)
+		return num_free;
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(sbi->free_pools, cpu);
+		spin_lock(&pool->lock);
+		num_free += pool->ext_end - pool->ext_low + pool->nr_freed;
+		spin_unlock(&pool->lock);
+	}
+	return num_free;
 }
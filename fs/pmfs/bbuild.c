@@ -57,7 +57,7 @@ static void pmfs_init_blockmap_from_inode(struct super_block *sb)
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
 	struct pmfs_inode *pi =  pmfs_get_inode(sb, PMFS_BLOCKNODE_IN0);
 	struct pmfs_blocknode_lowhigh *p = NULL;
-	struct pmfs_blocknode *blknode;
+	struct pmfs_blocknode *blknode, *prev = NULL;
 	unsigned long index;
 	unsigned long blocknr;
 	unsigned long i;
@@ -80,7 +80,8 @@ static void pmfs_init_blockmap_from_inode(struct super_block *sb)
                 	PMFS_ASSERT(0);
 		blknode->block_low = le64_to_cpu(p[index].block_low);
 		blknode->block_high = le64_to_cpu(p[index].block_high);
-		list_add_tail(&blknode->link, &sbi->block_inuse_head);
+		pmfs_insert_blocknode(sb, blknode, prev);
+		prev = blknode;
 	}
 }
 
@@ -137,7 +138,8 @@ static int pmfs_allocate_datablock_block_inode(pmfs_transaction_t *trans,
 	pi->i_size = cpu_to_le64(num_blocks << sb->s_blocksize_bits);
 	pmfs_memlock_inode(sb, pi);
 
-	errval = __pmfs_alloc_blocks(trans, sb, pi, 0, num_blocks, false);
+	errval = __pmfs_alloc_blocks(trans, sb, pi, NULL, 0, num_blocks,
+				     false);
 
 	return errval;
 }
@@ -310,119 +312,6 @@ static void pmfs_inode_table_crawl_recursive(struct super_block *sb,
 	}
 }
 
-static int pmfs_alloc_insert_blocknode_map(struct super_block *sb,
-	unsigned long low, unsigned long high)
-{
-	struct pmfs_sb_info *sbi = PMFS_SB(sb);
-	struct list_head *head = &(sbi->block_inuse_head);
-	struct pmfs_blocknode *i, *next_i;
-	struct pmfs_blocknode *free_blocknode= NULL;
-	unsigned long num_blocks = 0;
-	struct pmfs_blocknode *curr_node;
-	int errval = 0;
-	bool found = 0;
-	unsigned long next_block_low;
-	unsigned long new_block_low;
-	unsigned long new_block_high;
-
-	//num_blocks = pmfs_get_numblocks(btype);
-
-	new_block_low = low;
-	new_block_high = high;
-	num_blocks = high - low + 1;
-
-	list_for_each_entry(i, head, link) {
-		if (i->link.next == head) {
-			next_i = NULL;
-			next_block_low = sbi->block_end;
-		} else {
-			next_i = list_entry(i->link.next, typeof(*i), link);
-			next_block_low = next_i->block_low;
-		}
-
-
-		if (new_block_high >= next_block_low) {
-			/* Does not fit - skip to next blocknode */
-			continue;
-		}
-
-		if ((new_block_low == (i->block_high + 1)) &&
-			(new_block_high == (next_block_low - 1)))
-		{
-			/* Fill the gap completely */
-			if (next_i) {
-				i->block_high = next_i->block_high;
-				list_del(&next_i->link);
-				free_blocknode = next_i;
-			} else {
-				i->block_high = new_block_high;
-			}
-			found = 1;
-			break;
-		}
-
-		if ((new_block_low == (i->block_high + 1)) &&
-			(new_block_high < (next_block_low - 1))) {
-			/* Aligns to left */
-			i->block_high = new_block_high;
-			found = 1;
-			break;
-		}
-
-		if ((new_block_low > (i->block_high + 1)) &&
-			(new_block_high == (next_block_low - 1))) {
-			/* Aligns to right */
-			if (next_i) {
-				/* right node exist */
-				next_i->block_low = new_block_low;
-			} else {
-				/* right node does NOT exist */
-				curr_node = pmfs_alloc_blocknode(sb);
-				PMFS_ASSERT(curr_node);
-				if (curr_node == NULL) {
-					errval = -ENOSPC;
-					break;
-				}
-				curr_node->block_low = new_block_low;
-				curr_node->block_high = new_block_high;
-				list_add(&curr_node->link, &i->link);
-			}
-			found = 1;
-			break;
-		}
-
-		if ((new_block_low > (i->block_high + 1)) &&
-			(new_block_high < (next_block_low - 1))) {
-			/* Aligns somewhere in the middle */
-			curr_node = pmfs_alloc_blocknode(sb);
-			PMFS_ASSERT(curr_node);
-			if (curr_node == NULL) {
-				errval = -ENOSPC;
-				break;
-			}
-			curr_node->block_low = new_block_low;
-			curr_node->block_high = new_block_high;
-			list_add(&curr_node->link, &i->link);
-			found = 1;
-			break;
-		}
-	}
-	
-	if (found == 1) {
-		sbi->num_free_blocks -= num_blocks;
-	}	
-
-	if (free_blocknode)
-		pmfs_free_blocknode(sb, free_blocknode);
-
-	if (found == 0) {
-		return -ENOSPC;
-	}
-
-
-	return errval;
-}
-
 static int __pmfs_build_blocknode_map(struct super_block *sb,
 	unsigned long *bitmap, unsigned long bsize, unsigned long scale)
 {
@@ -435,7 +324,7 @@ static int __pmfs_build_blocknode_map(struct super_block *sb,
 			break;
 		low = next;
 		next = find_next_zero_bit(bitmap, bsize, next);
-		if (pmfs_alloc_insert_blocknode_map(sb, low << scale ,
+		if (__pmfs_reserve_blocks(sb, low << scale ,
 				(next << scale) - 1)) {
 			printk("PMFS: Error could not insert 0x%lx-0x%lx\n",
 				low << scale, ((next << scale) - 1));
@@ -504,7 +393,11 @@ int pmfs_setup_blocknode_map(struct super_block *sb)
 
 	/* initialize the num_free_blocks to */
 	sbi->num_free_blocks = ((unsigned long)(initsize) >> PAGE_SHIFT);
-	pmfs_init_blockmap(sb, le64_to_cpu(journal->base) + sbi->jsize);
+	/* the superblocks come first, and the journal follows them unless
+	 * it was moved by a resize */
+	pmfs_init_blockmap(sb, PMFS_SB_SIZE * 2);
+	__pmfs_reserve_blocks(sb, le64_to_cpu(journal->base) >> PAGE_SHIFT,
+		((le64_to_cpu(journal->base) + sbi->jsize) >> PAGE_SHIFT) - 1);
 
 	pmfs_build_blocknode_map(sb, &bm);
 
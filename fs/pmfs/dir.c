@@ -87,7 +87,7 @@ static int pmfs_add_dirent_to_buf(pmfs_transaction_t *trans,
 	de->name_len = namelen;
 	memcpy(de->name, name, namelen);
 	pmfs_memlock_block(dir->i_sb, blk_base);
-	pmfs_flush_buffer(de, reclen, false);
+	pmfs_dirty_range(dir->i_sb, de, reclen);
 	/*
 	 * XXX shouldn't update any times until successful
 	 * completion of syscall, but too many callers depend
@@ -172,6 +172,7 @@ int pmfs_remove_entry(pmfs_transaction_t *trans, struct dentry *de,
 	struct pmfs_inode *pidir;
 	struct qstr *entry = &de->d_name;
 	struct pmfs_direntry *res_entry, *prev_entry;
+	struct pmfs_log_range ranges[2];
 	int retval = -EINVAL;
 	unsigned long blocks, block;
 	char *blk_base = NULL;
@@ -194,27 +195,30 @@ int pmfs_remove_entry(pmfs_transaction_t *trans, struct dentry *de,
 
 	if (block == blocks)
 		goto out;
+	pidir = pmfs_get_inode(sb, dir->i_ino);
+	/* log the directory entry and the directory inode in one record */
 	if (prev_entry) {
-		pmfs_add_logentry(sb, trans, &prev_entry->de_len,
-				sizeof(prev_entry->de_len), LE_DATA);
-		pmfs_memunlock_block(sb, blk_base);
+		ranges[0].addr = &prev_entry->de_len;
+		ranges[0].size = sizeof(prev_entry->de_len);
+	} else {
+		ranges[0].addr = &res_entry->ino;
+		ranges[0].size = sizeof(res_entry->ino);
+	}
+	ranges[1].addr = pidir;
+	ranges[1].size = MAX_DATA_PER_LENTRY;
+	pmfs_add_logentries(sb, trans, ranges, 2, LE_DATA);
+
+	pmfs_memunlock_block(sb, blk_base);
+	if (prev_entry)
 		prev_entry->de_len =
 			cpu_to_le16(le16_to_cpu(prev_entry->de_len) +
 				    le16_to_cpu(res_entry->de_len));
-		pmfs_memlock_block(sb, blk_base);
-	} else {
-		pmfs_add_logentry(sb, trans, &res_entry->ino,
-				sizeof(res_entry->ino), LE_DATA);
-		pmfs_memunlock_block(sb, blk_base);
+	else
 		res_entry->ino = 0;
-		pmfs_memlock_block(sb, blk_base);
-	}
+	pmfs_memlock_block(sb, blk_base);
 	/*dir->i_version++; */
 	dir->i_ctime = dir->i_mtime = CURRENT_TIME_SEC;
 
-	pidir = pmfs_get_inode(sb, dir->i_ino);
-	pmfs_add_logentry(sb, trans, pidir, MAX_DATA_PER_LENTRY, LE_DATA);
-
 	pmfs_memunlock_inode(sb, pidir);
 	pidir->i_mtime = cpu_to_le32(dir->i_mtime.tv_sec);
 	pidir->i_ctime = cpu_to_le32(dir->i_ctime.tv_sec);
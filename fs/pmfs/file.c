@@ -258,6 +258,15 @@ static int pmfs_flush(struct file *file, fl_owner_t id)
 	return ret;
 }
 
+/* The last writer to close the file gives its preallocated blocks back */
+static int pmfs_release_file(struct inode *inode, struct file *file)
+{
+	if ((file->f_mode & FMODE_WRITE) &&
+	    atomic_read(&inode->i_writecount) == 1)
+		pmfs_discard_prealloc(inode);
+	return 0;
+}
+
 static unsigned long
 pmfs_get_unmapped_area(struct file *file, unsigned long addr,
 			unsigned long len, unsigned long pgoff,
@@ -320,6 +329,7 @@ const struct file_operations pmfs_xip_file_operations = {
 	.open			= generic_file_open,
 	.fsync			= pmfs_fsync,
 	.flush			= pmfs_flush,
+	.release		= pmfs_release_file,
 	.get_unmapped_area	= pmfs_get_unmapped_area,
 	.unlocked_ioctl		= pmfs_ioctl,
 	.fallocate		= pmfs_fallocate,
@@ -33,25 +33,165 @@ struct backing_dev_info pmfs_backing_dev_info __read_mostly = {
 unsigned int blk_type_to_shift[PMFS_BLOCK_TYPE_MAX] = {12, 21, 30};
 uint32_t blk_type_to_size[PMFS_BLOCK_TYPE_MAX] = {0x1000, 0x200000, 0x40000000};
 
+/* Caller must hold sbi->s_prealloc_lock.  Empties the inode's
+ * preallocation window and returns its extent in start and end. */
+static void __pmfs_take_prealloc(struct pmfs_sb_info *sbi,
+	struct pmfs_inode_info *si, unsigned long *start, unsigned long *end)
+{
+	*start = si->i_prealloc_start;
+	*end = si->i_prealloc_end;
+	sbi->num_prealloc_blocks -= *end - *start;
+	si->i_prealloc_start = si->i_prealloc_end = 0;
+	list_del_init(&si->i_prealloc_list);
+}
+
+/* Gives the unused part of the inode's preallocation window back */
+void pmfs_discard_prealloc(struct inode *inode)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(inode->i_sb);
+	struct pmfs_inode_info *si = PMFS_I(inode);
+	unsigned long start, end;
+
+	spin_lock(&sbi->s_prealloc_lock);
+	__pmfs_take_prealloc(sbi, si, &start, &end);
+	si->i_prealloc_size = PMFS_PREALLOC_MIN;
+	spin_unlock(&sbi->s_prealloc_lock);
+
+	if (start != end)
+		pmfs_free_blocks(inode->i_sb, start, end - start,
+				 PMFS_BLOCK_TYPE_4K);
+}
+
+/* Gives back the preallocation windows of all inodes, e.g. when the file
+ * system runs out of free blocks */
+void pmfs_discard_all_prealloc(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_inode_info *si;
+	unsigned long start, end;
+
+	spin_lock(&sbi->s_prealloc_lock);
+	while (!list_empty(&sbi->s_prealloc_list)) {
+		si = list_first_entry(&sbi->s_prealloc_list,
+				      struct pmfs_inode_info, i_prealloc_list);
+		__pmfs_take_prealloc(sbi, si, &start, &end);
+		spin_unlock(&sbi->s_prealloc_lock);
+
+		pmfs_free_blocks(sb, start, end - start, PMFS_BLOCK_TYPE_4K);
+		spin_lock(&sbi->s_prealloc_lock);
+	}
+	spin_unlock(&sbi->s_prealloc_lock);
+}
+
+/*
+ * allocate up to num contiguous 4K blocks for a file growing sequentially,
+ * i.e. with a goal right after its previous block. Blocks are handed out
+ * from the inode's preallocation window while the goal matches it;
+ * otherwise a new window of i_prealloc_size blocks past the request is
+ * allocated along with it, and the window size doubles for next time.
+ */
+static int pmfs_new_prealloc_blocks(struct super_block *sb,
+	struct pmfs_inode_info *si, unsigned long *blocknr, unsigned int num,
+	int zero, unsigned long goal)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	unsigned long start, end, size, low;
+	int allocated;
+
+	spin_lock(&sbi->s_prealloc_lock);
+	if (si->i_prealloc_start != si->i_prealloc_end &&
+	    si->i_prealloc_start == goal) {
+		allocated = min_t(unsigned long, num,
+				  si->i_prealloc_end - goal);
+		si->i_prealloc_start += allocated;
+		sbi->num_prealloc_blocks -= allocated;
+		if (si->i_prealloc_start == si->i_prealloc_end)
+			list_del_init(&si->i_prealloc_list);
+		spin_unlock(&sbi->s_prealloc_lock);
+
+		if (zero)
+			pmfs_zero_blocks(sb, goal, allocated,
+					 PMFS_BLOCK_TYPE_4K);
+		*blocknr = goal;
+		return allocated;
+	}
+
+	/* a window the file has moved away from is of no use any more */
+	__pmfs_take_prealloc(sbi, si, &start, &end);
+	if (start != end)
+		si->i_prealloc_size = PMFS_PREALLOC_MIN;
+	size = si->i_prealloc_size;
+	spin_unlock(&sbi->s_prealloc_lock);
+	if (start != end)
+		pmfs_free_blocks(sb, start, end - start, PMFS_BLOCK_TYPE_4K);
+
+	allocated = pmfs_new_blocks(sb, &low, num + size, PMFS_BLOCK_TYPE_4K,
+				    0, goal);
+	if (allocated <= 0)
+		return allocated;
+
+	start = low + min_t(unsigned long, num, allocated);
+	end = low + allocated;
+	if (start != end) {
+		spin_lock(&sbi->s_prealloc_lock);
+		if (si->i_prealloc_start == si->i_prealloc_end) {
+			si->i_prealloc_start = start;
+			si->i_prealloc_end = end;
+			sbi->num_prealloc_blocks += end - start;
+			list_add_tail(&si->i_prealloc_list,
+				      &sbi->s_prealloc_list);
+			start = end;
+		}
+		si->i_prealloc_size = min_t(unsigned long, size * 2,
+					    PMFS_PREALLOC_MAX);
+		spin_unlock(&sbi->s_prealloc_lock);
+		/* raced with another allocation for this inode */
+		if (start != end)
+			pmfs_free_blocks(sb, start, end - start,
+					 PMFS_BLOCK_TYPE_4K);
+	}
+
+	allocated = min_t(unsigned long, num, allocated);
+	if (zero)
+		pmfs_zero_blocks(sb, low, allocated, PMFS_BLOCK_TYPE_4K);
+	*blocknr = low;
+	return allocated;
+}
+
 /*
- * allocate a data block for inode and return it's absolute blocknr.
- * Zeroes out the block if zero set. Increments inode->i_blocks.
+ * allocate up to num contiguous data blocks for inode and return the
+ * absolute blocknr of the first one, preferring to start at goal. Zeroes
+ * out the blocks if zero set. Increments inode->i_blocks. Returns the
+ * number of blocks allocated. si is set for regular files, whose
+ * sequential appends are served from a preallocation window.
  */
-static int pmfs_new_data_block(struct super_block *sb, struct pmfs_inode *pi,
-		unsigned long *blocknr, int zero)
+static int pmfs_new_data_blocks(struct super_block *sb, struct pmfs_inode *pi,
+		struct pmfs_inode_info *si, unsigned long *blocknr,
+		unsigned int num, int zero, unsigned long goal)
 {
 	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
+	int allocated;
 
-	int errval = pmfs_new_block(sb, blocknr, pi->i_blk_type, zero);
+	if (si && goal && pi->i_blk_type == PMFS_BLOCK_TYPE_4K)
+		allocated = pmfs_new_prealloc_blocks(sb, si, blocknr, num,
+						     zero, goal);
+	else
+		allocated = pmfs_new_blocks(sb, blocknr, num, pi->i_blk_type,
+					    zero, goal);
+	if (allocated == -ENOSPC && PMFS_SB(sb)->num_prealloc_blocks) {
+		pmfs_discard_all_prealloc(sb);
+		allocated = pmfs_new_blocks(sb, blocknr, num, pi->i_blk_type,
+					    zero, goal);
+	}
 
-	if (!errval) {
+	if (allocated > 0) {
 		pmfs_memunlock_inode(sb, pi);
 		le64_add_cpu(&pi->i_blocks,
-			(1 << (data_bits - sb->s_blocksize_bits)));
+			allocated << (data_bits - sb->s_blocksize_bits));
 		pmfs_memlock_inode(sb, pi);
 	}
 
-	return errval;
+	return allocated;
 }
 
 /*
@@ -242,10 +382,12 @@ static inline bool is_empty_meta_block(__le64 *node, unsigned int start_idx,
  * first_blocknr: first block in the specified range
  * last_blocknr: last_blocknr in the specified range
  * end: last byte offset of the range
+ * batch: collects the freed data and meta blocks; the caller flushes it
  */
 static int recursive_truncate_blocks(struct super_block *sb, __le64 block,
 	u32 height, u32 btype, unsigned long first_blocknr,
-	unsigned long last_blocknr, bool *meta_empty)
+	unsigned long last_blocknr, bool *meta_empty,
+	struct pmfs_free_batch *batch)
 {
 	unsigned long blocknr, first_blk, last_blk;
 	unsigned int node_bits, first_index, last_index, i;
@@ -253,7 +395,6 @@ static int recursive_truncate_blocks(struct super_block *sb, __le64 block,
 	unsigned int freed = 0, bzero;
 	int start, end;
 	bool mpty, all_range_freed = true;
-	struct pmfs_sb_info *sbi = PMFS_SB(sb);
 
 	node = pmfs_get_block(sb, le64_to_cpu(block));
 
@@ -263,18 +404,16 @@ static int recursive_truncate_blocks(struct super_block *sb, __le64 block,
 	end = last_index = last_blocknr >> node_bits;
 
 	if (height == 1) {
-		struct pmfs_blocknode *start_hint = NULL;
-		mutex_lock(&sbi->s_lock);
 		for (i = first_index; i <= last_index; i++) {
 			if (unlikely(!node[i]))
 				continue;
 			/* Freeing the data block */
 			blocknr = pmfs_get_blocknr(sb, le64_to_cpu(node[i]),
 				    btype);
-			__pmfs_free_block(sb, blocknr, btype, &start_hint);
+			pmfs_free_batch_add(sb, batch, blocknr,
+					    pmfs_get_numblocks(btype));
 			freed++;
 		}
-		mutex_unlock(&sbi->s_lock);
 	} else {
 		for (i = first_index; i <= last_index; i++) {
 			if (unlikely(!node[i]))
@@ -286,13 +425,14 @@ static int recursive_truncate_blocks(struct super_block *sb, __le64 block,
 				((1 << node_bits) - 1)) : (1 << node_bits) - 1;
 
 			freed += recursive_truncate_blocks(sb, node[i],
-				height - 1, btype, first_blk, last_blk, &mpty);
+				height - 1, btype, first_blk, last_blk, &mpty,
+				batch);
 			/* cond_resched(); */
 			if (mpty) {
 				/* Freeing the meta-data block */
 				blocknr = pmfs_get_blocknr(sb, le64_to_cpu(
 					    node[i]), PMFS_BLOCK_TYPE_4K);
-				pmfs_free_block(sb, blocknr,PMFS_BLOCK_TYPE_4K);
+				pmfs_free_batch_add(sb, batch, blocknr, 1);
 			} else {
 				if (i == first_index)
 				    start++;
@@ -312,7 +452,7 @@ static int recursive_truncate_blocks(struct super_block *sb, __le64 block,
 			pmfs_memunlock_block(sb, node);
 			memset(&node[start], 0, bzero);
 			pmfs_memlock_block(sb, node);
-			pmfs_flush_buffer(&node[start], bzero, false);
+			pmfs_dirty_range(sb, &node[start], bzero);
 		}
 		*meta_empty = false;
 	}
@@ -322,6 +462,7 @@ static int recursive_truncate_blocks(struct super_block *sb, __le64 block,
 unsigned int pmfs_free_inode_subtree(struct super_block *sb,
 		__le64 root, u32 height, u32 btype, unsigned long last_blocknr)
 {
+	struct pmfs_free_batch batch = { .nr = 0 };
 	unsigned long first_blocknr;
 	unsigned int freed;
 	bool mpty;
@@ -338,11 +479,12 @@ unsigned int pmfs_free_inode_subtree(struct super_block *sb,
 		first_blocknr = 0;
 
 		freed = recursive_truncate_blocks(sb, root, height, btype,
-			first_blocknr, last_blocknr, &mpty);
+			first_blocknr, last_blocknr, &mpty, &batch);
 		BUG_ON(!mpty);
 		first_blocknr = pmfs_get_blocknr(sb, le64_to_cpu(root),
 			PMFS_BLOCK_TYPE_4K);
-		pmfs_free_block(sb, first_blocknr,PMFS_BLOCK_TYPE_4K);
+		pmfs_free_batch_add(sb, &batch, first_blocknr, 1);
+		pmfs_free_batch_flush(sb, &batch);
 	}
 	return freed;
 }
@@ -441,6 +583,7 @@ static void __pmfs_truncate_blocks(struct inode *inode, loff_t start,
 {
 	struct super_block *sb = inode->i_sb;
 	struct pmfs_inode *pi = pmfs_get_inode(sb, inode->i_ino);
+	struct pmfs_free_batch batch = { .nr = 0 };
 	unsigned long first_blocknr, last_blocknr;
 	__le64 root;
 	unsigned int freed = 0;
@@ -472,6 +615,8 @@ static void __pmfs_truncate_blocks(struct inode *inode, loff_t start,
 		goto end_truncate_blocks;
 	root = pi->root;
 
+	/* meta blocks are freed and the tree may shrink */
+	down_write(&PMFS_I(inode)->i_tree_sem);
 	if (pi->height == 0) {
 		first_blocknr = pmfs_get_blocknr(sb, le64_to_cpu(root),
 			pi->i_blk_type);
@@ -480,13 +625,15 @@ static void __pmfs_truncate_blocks(struct inode *inode, loff_t start,
 		freed = 1;
 	} else {
 		freed = recursive_truncate_blocks(sb, root, pi->height,
-			pi->i_blk_type, first_blocknr, last_blocknr, &mpty);
+			pi->i_blk_type, first_blocknr, last_blocknr, &mpty,
+			&batch);
 		if (mpty) {
 			first_blocknr = pmfs_get_blocknr(sb, le64_to_cpu(root),
 				PMFS_BLOCK_TYPE_4K);
-			pmfs_free_block(sb, first_blocknr, PMFS_BLOCK_TYPE_4K);
+			pmfs_free_batch_add(sb, &batch, first_blocknr, 1);
 			root = 0;
 		}
+		pmfs_free_batch_flush(sb, &batch);
 	}
 	/* if we are called during mount, a power/system failure had happened.
 	 * Don't trust inode->i_blocks; recalculate it by rescanning the inode
@@ -505,8 +652,9 @@ static void __pmfs_truncate_blocks(struct inode *inode, loff_t start,
 	/* Check for the flag EOFBLOCKS is still valid after the set size */
 	check_eof_blocks(sb, pi, inode->i_size);
 	pmfs_memlock_inode(sb, pi);
+	up_write(&PMFS_I(inode)->i_tree_sem);
 	/* now flush the inode's first cacheline which was modified */
-	pmfs_flush_buffer(pi, 1, false);
+	pmfs_dirty_range(sb, pi, 1);
 	return;
 end_truncate_blocks:
 	/* we still need to update ctime and mtime */
@@ -514,12 +662,26 @@ end_truncate_blocks:
 	pi->i_mtime = cpu_to_le32(inode->i_mtime.tv_sec);
 	pi->i_ctime = cpu_to_le32(inode->i_ctime.tv_sec);
 	pmfs_memlock_inode(sb, pi);
-	pmfs_flush_buffer(pi, 1, false);
+	pmfs_dirty_range(sb, pi, 1);
+}
+
+
+/* si is NULL for the internal inodes, which have no lockless walkers */
+static inline void pmfs_tree_write_lock(struct pmfs_inode_info *si)
+{
+	if (si)
+		down_write(&si->i_tree_sem);
 }
 
+static inline void pmfs_tree_write_unlock(struct pmfs_inode_info *si)
+{
+	if (si)
+		up_write(&si->i_tree_sem);
+}
 
 static int pmfs_increase_btree_height(struct super_block *sb,
-		struct pmfs_inode *pi, u32 new_height)
+		struct pmfs_inode_info *si, struct pmfs_inode *pi,
+		u32 new_height)
 {
 	u32 height = pi->height;
 	__le64 *root, prev_root = pi->root;
@@ -539,14 +701,17 @@ static int pmfs_increase_btree_height(struct super_block *sb,
 		pmfs_memunlock_block(sb, root);
 		root[0] = prev_root;
 		pmfs_memlock_block(sb, root);
-		pmfs_flush_buffer(root, sizeof(*root), false);
+		pmfs_dirty_range(sb, root, sizeof(*root));
 		prev_root = cpu_to_le64(blocknr);
 		height++;
 	}
+	/* root and height are separate stores */
+	pmfs_tree_write_lock(si);
 	pmfs_memunlock_inode(sb, pi);
 	pi->root = prev_root;
 	pi->height = height;
 	pmfs_memlock_inode(sb, pi);
+	pmfs_tree_write_unlock(si);
 	return errval;
 }
 
@@ -558,17 +723,20 @@ static int pmfs_increase_btree_height(struct super_block *sb,
  * first_blocknr: first block in the specified range
  * last_blocknr: last_blocknr in the specified range
  * zero: whether to zero-out the allocated block(s)
+ * goal: physical block to place the next data block at, updated as blocks
+ *       are allocated so that the range stays contiguous where possible
+ * si: in-memory inode whose preallocation window may be used, or NULL
  */
 static int recursive_alloc_blocks(pmfs_transaction_t *trans,
 	struct super_block *sb, struct pmfs_inode *pi, __le64 block, u32 height,
 	unsigned long first_blocknr, unsigned long last_blocknr, bool new_node,
-	bool zero)
+	bool zero, unsigned long *goal, struct pmfs_inode_info *si)
 {
-	int i, errval;
+	int i, j, errval;
 	unsigned int meta_bits = META_BLK_SHIFT, node_bits;
 	__le64 *node;
 	bool journal_saved = 0;
-	unsigned long blocknr, first_blk, last_blk;
+	unsigned long blocknr, first_blk, last_blk, blocks_per_unit;
 	unsigned int first_index, last_index;
 	unsigned int flush_bytes;
 
@@ -579,12 +747,24 @@ static int recursive_alloc_blocks(pmfs_transaction_t *trans,
 	first_index = first_blocknr >> node_bits;
 	last_index = last_blocknr >> node_bits;
 
+	blocks_per_unit = pmfs_get_numblocks(pi->i_blk_type);
+
 	for (i = first_index; i <= last_index; i++) {
 		if (height == 1) {
 			if (node[i] == 0) {
-				errval = pmfs_new_data_block(sb, pi, &blocknr,
-							zero);
-				if (errval) {
+				/* fill the run of empty slots starting at i
+				 * from as few allocator calls as possible */
+				for (j = i + 1; j <= last_index && !node[j]; j++)
+					;
+				/* a hole continues the block before it */
+				if (i > 0 && node[i - 1])
+					*goal = pmfs_get_blocknr(sb,
+						le64_to_cpu(node[i - 1]),
+						pi->i_blk_type) +
+						blocks_per_unit;
+				errval = pmfs_new_data_blocks(sb, pi, si,
+						&blocknr, j - i, zero, *goal);
+				if (errval < 0) {
 					pmfs_dbg_verbose("alloc data blk failed"
 						" %d\n", errval);
 					/* For later recovery in truncate... */
@@ -603,9 +783,14 @@ static int recursive_alloc_blocks(pmfs_transaction_t *trans,
 					journal_saved = 1;
 				}
 				pmfs_memunlock_block(sb, node);
-				node[i] = cpu_to_le64(pmfs_get_block_off(sb,
-						blocknr, pi->i_blk_type));
+				for (j = i + errval; i < j; i++) {
+					node[i] = cpu_to_le64(pmfs_get_block_off(
+						sb, blocknr, pi->i_blk_type));
+					blocknr += blocks_per_unit;
+				}
 				pmfs_memlock_block(sb, node);
+				*goal = blocknr;
+				i--;
 			}
 		} else {
 			if (node[i] == 0) {
@@ -639,7 +824,8 @@ static int recursive_alloc_blocks(pmfs_transaction_t *trans,
 				((1 << node_bits) - 1)) : (1 << node_bits) - 1;
 
 			errval = recursive_alloc_blocks(trans, sb, pi, node[i],
-			height - 1, first_blk, last_blk, new_node, zero);
+			height - 1, first_blk, last_blk, new_node, zero, goal,
+			si);
 			if (errval < 0)
 				goto fail;
 		}
@@ -648,7 +834,7 @@ static int recursive_alloc_blocks(pmfs_transaction_t *trans,
 		/* if the changes were not logged, flush the cachelines we may
 	 	* have modified */
 		flush_bytes = (last_index - first_index + 1) * sizeof(node[0]);
-		pmfs_flush_buffer(&node[first_index], flush_bytes, false);
+		pmfs_dirty_range(sb, &node[first_index], flush_bytes);
 	}
 	errval = 0;
 fail:
@@ -656,8 +842,8 @@ fail:
 }
 
 int __pmfs_alloc_blocks(pmfs_transaction_t *trans, struct super_block *sb,
-	struct pmfs_inode *pi, unsigned long file_blocknr, unsigned int num,
-	bool zero)
+	struct pmfs_inode *pi, struct pmfs_inode_info *si,
+	unsigned long file_blocknr, unsigned int num, bool zero)
 {
 	int errval;
 	unsigned long max_blocks;
@@ -665,12 +851,24 @@ int __pmfs_alloc_blocks(pmfs_transaction_t *trans, struct super_block *sb,
 	unsigned int data_bits = blk_type_to_shift[pi->i_blk_type];
 	unsigned int blk_shift, meta_bits = META_BLK_SHIFT;
 	unsigned long blocknr, first_blocknr, last_blocknr, total_blocks;
+	unsigned long goal = 0;
+	u64 bp;
 	/* convert the 4K blocks into the actual blocks the inode is using */
 	blk_shift = data_bits - sb->s_blocksize_bits;
 
 	first_blocknr = file_blocknr >> blk_shift;
 	last_blocknr = (file_blocknr + num - 1) >> blk_shift;
 
+	/* place the new blocks right after the file's preceding block, so
+	 * that appends build long physically contiguous runs */
+	if (pi->root && first_blocknr > 0 &&
+	    first_blocknr - 1 < (1UL << (pi->height * meta_bits))) {
+		bp = __pmfs_find_data_block(sb, pi, first_blocknr - 1);
+		if (bp)
+			goal = pmfs_get_blocknr(sb, bp, pi->i_blk_type) +
+				pmfs_get_numblocks(pi->i_blk_type);
+	}
+
 	pmfs_dbg_verbose("alloc_blocks height %d file_blocknr %lx num %x, "
 		   "first blocknr 0x%lx, last_blocknr 0x%lx\n",
 		   pi->height, file_blocknr, num, first_blocknr, last_blocknr);
@@ -699,27 +897,32 @@ int __pmfs_alloc_blocks(pmfs_transaction_t *trans, struct super_block *sb,
 	if (!pi->root) {
 		if (height == 0) {
 			__le64 root;
-			errval = pmfs_new_data_block(sb, pi, &blocknr, zero);
-			if (errval) {
+			errval = pmfs_new_data_blocks(sb, pi, si, &blocknr, 1,
+						      zero, goal);
+			if (errval < 0) {
 				pmfs_dbg_verbose("[%s:%d] failed: alloc data"
 					" block\n", __func__, __LINE__);
 				goto fail;
 			}
 			root = cpu_to_le64(pmfs_get_block_off(sb, blocknr,
 					   pi->i_blk_type));
+			pmfs_tree_write_lock(si);
 			pmfs_memunlock_inode(sb, pi);
 			pi->root = root;
 			pi->height = height;
 			pmfs_memlock_inode(sb, pi);
+			pmfs_tree_write_unlock(si);
 		} else {
-			errval = pmfs_increase_btree_height(sb, pi, height);
+			errval = pmfs_increase_btree_height(sb, si, pi,
+				height);
 			if (errval) {
 				pmfs_dbg_verbose("[%s:%d] failed: inc btree"
 					" height\n", __func__, __LINE__);
 				goto fail;
 			}
 			errval = recursive_alloc_blocks(trans, sb, pi, pi->root,
-			pi->height, first_blocknr, last_blocknr, 1, zero);
+			pi->height, first_blocknr, last_blocknr, 1, zero,
+			&goal, si);
 			if (errval < 0)
 				goto fail;
 		}
@@ -729,7 +932,8 @@ int __pmfs_alloc_blocks(pmfs_transaction_t *trans, struct super_block *sb,
 			return 0;
 
 		if (height > pi->height) {
-			errval = pmfs_increase_btree_height(sb, pi, height);
+			errval = pmfs_increase_btree_height(sb, si, pi,
+				height);
 			if (errval) {
 				pmfs_dbg_verbose("Err: inc height %x:%x tot %lx"
 					"\n", pi->height, height, total_blocks);
@@ -737,7 +941,8 @@ int __pmfs_alloc_blocks(pmfs_transaction_t *trans, struct super_block *sb,
 			}
 		}
 		errval = recursive_alloc_blocks(trans, sb, pi, pi->root, height,
-				first_blocknr, last_blocknr, 0, zero);
+				first_blocknr, last_blocknr, 0, zero, &goal,
+				si);
 		if (errval < 0)
 			goto fail;
 	}
@@ -757,12 +962,190 @@ inline int pmfs_alloc_blocks(pmfs_transaction_t *trans, struct inode *inode,
 	struct pmfs_inode *pi = pmfs_get_inode(sb, inode->i_ino);
 	int errval;
 
-	errval = __pmfs_alloc_blocks(trans, sb, pi, file_blocknr, num, zero);
+	errval = __pmfs_alloc_blocks(trans, sb, pi,
+			S_ISREG(inode->i_mode) ? PMFS_I(inode) : NULL,
+			file_blocknr, num, zero);
 	inode->i_blocks = le64_to_cpu(pi->i_blocks);
 
 	return errval;
 }
 
+/* State for building a file's new b-tree in pmfs_migrate_blocks() */
+struct pmfs_migrate_ctx {
+	struct inode	*inode;
+	struct pmfs_inode *pi;		/* the file's current tree */
+	unsigned short	btype;		/* block type of the new tree */
+	unsigned long	index;		/* next file block, in new blocks */
+	unsigned long	count;		/* new data blocks needed */
+	unsigned long	next;		/* current run of new data blocks */
+	unsigned long	left;
+};
+
+/* Copies the data of new file block ctx->index into the block at blocknr.
+ * Holes and anything past i_size read as zeroes. */
+static void pmfs_migrate_copy(struct super_block *sb,
+	struct pmfs_migrate_ctx *ctx, unsigned long blocknr)
+{
+	struct pmfs_inode *pi = ctx->pi;
+	unsigned long new_size = blk_type_to_size[ctx->btype];
+	unsigned long old_size = pmfs_inode_blk_size(pi);
+	unsigned long off, old_blocknr;
+	loff_t pos = (loff_t)ctx->index * new_size;
+	char *dst;
+	u64 bp;
+
+	dst = pmfs_get_block(sb, pmfs_get_block_off(sb, blocknr, ctx->btype));
+	for (off = 0; off < new_size; off += old_size) {
+		bp = 0;
+		old_blocknr = (pos + off) >> pmfs_inode_blk_shift(pi);
+		if (pos + off < ctx->inode->i_size &&
+		    old_blocknr < (1UL << (pi->height * META_BLK_SHIFT)))
+			bp = __pmfs_find_data_block(sb, pi, old_blocknr);
+
+		pmfs_memunlock_range(sb, dst + off, old_size);
+		if (bp)
+			memcpy(dst + off, pmfs_get_block(sb, bp), old_size);
+		else
+			memset(dst + off, 0, old_size);
+		pmfs_memlock_range(sb, dst + off, old_size);
+		pmfs_flush_buffer(dst + off, old_size, false);
+		cond_resched();
+	}
+}
+
+/* Builds a subtree of the given height holding the next new data blocks,
+ * allocating them in as long contiguous runs as possible, and returns its
+ * root in *root.  A failed build leaves a partial tree in *root. */
+static int pmfs_migrate_build(struct super_block *sb,
+	struct pmfs_migrate_ctx *ctx, __le64 *root, u32 height)
+{
+	unsigned long blocknr;
+	__le64 *node;
+	int i, errval;
+
+	if (height == 0) {
+		if (!ctx->left) {
+			errval = pmfs_new_blocks(sb, &blocknr,
+				min_t(unsigned long, ctx->count - ctx->index,
+				      UINT_MAX), ctx->btype, 0, ctx->next);
+			if (errval < 0)
+				return errval;
+			ctx->next = blocknr;
+			ctx->left = errval;
+		}
+		pmfs_migrate_copy(sb, ctx, ctx->next);
+		*root = cpu_to_le64(pmfs_get_block_off(sb, ctx->next,
+						       ctx->btype));
+		ctx->next += pmfs_get_numblocks(ctx->btype);
+		ctx->left--;
+		ctx->index++;
+		return 0;
+	}
+
+	errval = pmfs_new_block(sb, &blocknr, PMFS_BLOCK_TYPE_4K, 1);
+	if (errval)
+		return errval;
+	*root = cpu_to_le64(pmfs_get_block_off(sb, blocknr,
+					       PMFS_BLOCK_TYPE_4K));
+	node = pmfs_get_block(sb, le64_to_cpu(*root));
+	errval = 0;
+	for (i = 0; i < (1 << META_BLK_SHIFT) && ctx->index < ctx->count;
+	     i++) {
+		__le64 child = 0;
+
+		errval = pmfs_migrate_build(sb, ctx, &child, height - 1);
+		pmfs_memunlock_block(sb, node);
+		node[i] = child;
+		pmfs_memlock_block(sb, node);
+		if (errval)
+			break;
+	}
+	pmfs_flush_buffer(node, i * sizeof(node[0]), false);
+	return errval;
+}
+
+/*
+ * Rewrites a regular file's data into contiguous blocks of type btype,
+ * which must be larger than the file's current block type, and switches
+ * the file over to them in one transaction.  The new tree is built off to
+ * the side, so a crash before the switch only leaks blocks until the next
+ * full rebuild of the block map.  Caller must hold i_mutex and the range
+ * lock of the whole file, and make sure the file is not mapped.
+ */
+int pmfs_migrate_blocks(struct inode *inode, unsigned short btype)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pmfs_inode *pi = pmfs_get_inode(sb, inode->i_ino);
+	struct pmfs_migrate_ctx ctx = { .inode = inode, .pi = pi,
+					.btype = btype };
+	pmfs_transaction_t *trans;
+	__le64 root = 0, old_root;
+	unsigned int height = 0, old_height, old_btype;
+	unsigned long last_blocknr;
+	int errval;
+
+	if (btype >= PMFS_BLOCK_TYPE_MAX || btype <= pi->i_blk_type)
+		return -EINVAL;
+
+	ctx.count = (inode->i_size + blk_type_to_size[btype] - 1) >>
+		blk_type_to_shift[btype];
+	last_blocknr = ctx.count ? ctx.count - 1 : 0;
+	while (last_blocknr) {
+		last_blocknr >>= META_BLK_SHIFT;
+		height++;
+	}
+
+	pmfs_discard_prealloc(inode);
+
+	if (ctx.count) {
+		errval = pmfs_migrate_build(sb, &ctx, &root, height);
+		if (errval) {
+			if (ctx.left)
+				pmfs_free_blocks(sb, ctx.next, ctx.left, btype);
+			pmfs_free_inode_subtree(sb, root, height, btype,
+				(1UL << (height * META_BLK_SHIFT)) - 1);
+			return errval;
+		}
+	}
+
+	trans = pmfs_new_transaction(sb, MAX_INODE_LENTRIES);
+	if (IS_ERR(trans)) {
+		pmfs_free_inode_subtree(sb, root, height, btype,
+			(1UL << (height * META_BLK_SHIFT)) - 1);
+		return PTR_ERR(trans);
+	}
+	pmfs_add_logentry(sb, trans, pi, MAX_DATA_PER_LENTRY, LE_DATA);
+
+	old_root = pi->root;
+	old_height = pi->height;
+	old_btype = pi->i_blk_type;
+	if (pi->i_flags & cpu_to_le32(PMFS_EOFBLOCKS_FL))
+		last_blocknr = (1UL << (old_height * META_BLK_SHIFT)) - 1;
+	else
+		last_blocknr = pmfs_sparse_last_blocknr(old_height,
+			inode->i_size ? (inode->i_size - 1) >>
+			pmfs_inode_blk_shift(pi) : 0);
+
+	down_write(&PMFS_I(inode)->i_tree_sem);
+	pmfs_memunlock_inode(sb, pi);
+	pi->root = root;
+	pi->height = height;
+	pi->i_blk_type = btype;
+	pi->i_blocks = cpu_to_le64(ctx.count <<
+		(blk_type_to_shift[btype] - sb->s_blocksize_bits));
+	pi->i_flags &= cpu_to_le32(~PMFS_EOFBLOCKS_FL);
+	pmfs_memlock_inode(sb, pi);
+	up_write(&PMFS_I(inode)->i_tree_sem);
+	pmfs_commit_transaction(sb, trans);
+	inode->i_blocks = le64_to_cpu(pi->i_blocks);
+
+	/* drop any mapping of the old blocks set up while copying */
+	unmap_mapping_range(inode->i_mapping, 0, 0, 1);
+	pmfs_free_inode_subtree(sb, old_root, old_height, old_btype,
+				last_blocknr);
+	return 0;
+}
+
 /* Initialize the inode table. The pmfs_inode struct corresponding to the
  * inode table has already been zero'd out */
 int pmfs_init_inode_table(struct super_block *sb)
@@ -807,7 +1190,7 @@ int pmfs_init_inode_table(struct super_block *sb)
 	/* calculate num_blocks in terms of 4k blocksize */
 	num_blocks = num_blocks << (pmfs_inode_blk_shift(pi) -
 					sb->s_blocksize_bits);
-	errval = __pmfs_alloc_blocks(NULL, sb, pi, 0, num_blocks, true);
+	errval = __pmfs_alloc_blocks(NULL, sb, pi, NULL, 0, num_blocks, true);
 
 	if (errval != 0) {
 		pmfs_err(sb, "Err: initializing the Inode Table: %d\n", errval);
@@ -1010,6 +1393,8 @@ void pmfs_evict_inode(struct inode *inode)
 	unsigned int height, btype;
 	int err = 0;
 
+	pmfs_discard_prealloc(inode);
+
 	if (!inode->i_nlink && !is_bad_inode(inode)) {
 		if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
 			S_ISLNK(inode->i_mode)))
@@ -1069,7 +1454,7 @@ static int pmfs_increase_inode_table_size(struct super_block *sb)
 
 	pmfs_add_logentry(sb, trans, pi, MAX_DATA_PER_LENTRY, LE_DATA);
 
-	errval = __pmfs_alloc_blocks(trans, sb, pi,
+	errval = __pmfs_alloc_blocks(trans, sb, pi, NULL,
 			le64_to_cpup(&pi->i_size) >> sb->s_blocksize_bits,
 			1, true);
 
@@ -1410,9 +1795,51 @@ out_unlock:
 	mutex_unlock(&PMFS_SB(sb)->s_truncate_lock);
 }
 
+static bool pmfs_range_trylock(struct pmfs_range_lock *rl,
+	struct pmfs_range *range)
+{
+	struct pmfs_range *r;
+
+	spin_lock(&rl->lock);
+	list_for_each_entry(r, &rl->ranges, list) {
+		if (r->start < range->end && range->start < r->end) {
+			spin_unlock(&rl->lock);
+			return false;
+		}
+	}
+	list_add(&range->list, &rl->ranges);
+	spin_unlock(&rl->lock);
+	return true;
+}
+
+/* Waits until no held range overlaps [start, end), then takes it. Only a
+ * handful of ranges are held at a time, one per writer, so a list will do. */
+void pmfs_range_lock(struct inode *inode, struct pmfs_range *range,
+	loff_t start, loff_t end)
+{
+	struct pmfs_range_lock *rl = &PMFS_I(inode)->i_range_lock;
+
+	range->start = start;
+	range->end = end;
+	wait_event(rl->wait, pmfs_range_trylock(rl, range));
+}
+
+void pmfs_range_unlock(struct inode *inode, struct pmfs_range *range)
+{
+	struct pmfs_range_lock *rl = &PMFS_I(inode)->i_range_lock;
+
+	spin_lock(&rl->lock);
+	list_del(&range->list);
+	spin_unlock(&rl->lock);
+	wake_up_all(&rl->wait);
+}
+
+/* Caller holds i_mutex. Lockless overwriters are kept out of the blocks
+ * being freed by the range lock. */
 void pmfs_setsize(struct inode *inode, loff_t newsize)
 {
 	loff_t oldsize = inode->i_size;
+	struct pmfs_range range;
 
 	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
 	      S_ISLNK(inode->i_mode))) {
@@ -1420,6 +1847,7 @@ void pmfs_setsize(struct inode *inode, loff_t newsize)
 		return;
 	}
 
+	pmfs_range_lock(inode, &range, min(newsize, oldsize), LLONG_MAX);
 	if (newsize != oldsize) {
 		pmfs_block_truncate_page(inode, newsize);
 		i_size_write(inode, newsize);
@@ -1429,6 +1857,7 @@ void pmfs_setsize(struct inode *inode, loff_t newsize)
 	 * from application address space, if mmapped. */
 	/* synchronize_rcu(); */
 	__pmfs_truncate_blocks(inode, newsize, oldsize);
+	pmfs_range_unlock(inode, &range);
 	/* No need to make the b-tree persistent here if we are called from
 	 * within a transaction, because the transaction will provide a
 	 * subsequent persistent barrier */
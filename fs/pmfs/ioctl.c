@@ -120,6 +120,35 @@ setversion_out:
 		mnt_drop_write_file(filp);
 		return ret;
 	}
+	case PMFS_IOC_DEFRAG: {
+		unsigned int btype;
+
+		if (!S_ISREG(inode->i_mode))
+			return -EINVAL;
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (get_user(btype, (unsigned int __user *)arg))
+			return -EFAULT;
+		ret = mnt_want_write_file(filp);
+		if (ret)
+			return ret;
+		mutex_lock(&inode->i_mutex);
+		if (IS_APPEND(inode) || IS_IMMUTABLE(inode))
+			ret = -EPERM;
+		else if (mapping_mapped(inode->i_mapping))
+			/* mapped pages would keep using the old blocks */
+			ret = -EBUSY;
+		else {
+			struct pmfs_range range;
+
+			pmfs_range_lock(inode, &range, 0, LLONG_MAX);
+			ret = pmfs_migrate_blocks(inode, btype);
+			pmfs_range_unlock(inode, &range);
+		}
+		mutex_unlock(&inode->i_mutex);
+		mnt_drop_write_file(filp);
+		return ret;
+	}
 	default:
 		return -ENOTTY;
 	}
@@ -141,6 +170,8 @@ long pmfs_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case FS_IOC32_SETVERSION:
 		cmd = FS_IOC_SETVERSION;
 		break;
+	case PMFS_IOC_DEFRAG:
+		break;
 	default:
 		return -ENOIOCTLCMD;
 	}
@@ -28,22 +28,34 @@
 #include <linux/mm.h>
 #include <linux/mutex.h>
 #include <linux/sched.h>
-#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/crc32c.h>
+#include <linux/log2.h>
 #include "pmfs.h"
 #include "journal.h"
 
+static inline pmfs_logrec_t *pmfs_next_logrec(pmfs_logrec_t *rec)
+{
+	return (void *)rec + le16_to_cpu(rec->size);
+}
+
+/* walks the records a transaction has written */
+#define for_each_logrec(rec, trans)					\
+	for (rec = (trans)->start_addr;					\
+	     (void *)rec < (trans)->start_addr + (trans)->used;		\
+	     rec = pmfs_next_logrec(rec))
+
 static void dump_transaction(struct pmfs_sb_info *sbi,
 		pmfs_transaction_t *trans)
 {
-	int i;
-	pmfs_logentry_t *le = trans->start_addr;
+	pmfs_logrec_t *rec;
 
-	for (i = 0; i < trans->num_entries; i++) {
-		pmfs_dbg_trans("ao %llx tid %x gid %x type %x sz %x\n",
-			le->addr_offset, le->transaction_id, le->gen_id,
-			le->type, le->size);
-		le++;
-	}
+	for_each_logrec(rec, trans)
+		pmfs_dbg_trans("tid %x gid %x type %x sz %x nr %x\n",
+			trans->transaction_id, trans->gen_id, rec->type,
+			le16_to_cpu(rec->size), rec->nr_ranges);
 }
 
 static inline uint32_t next_log_entry(uint32_t jsize, uint32_t le_off)
@@ -54,14 +66,6 @@ static inline uint32_t next_log_entry(uint32_t jsize, uint32_t le_off)
 	return le_off;
 }
 
-static inline uint32_t prev_log_entry(uint32_t jsize, uint32_t le_off)
-{
-	if (le_off == 0)
-		le_off = jsize;
-	le_off = le_off - LOGENTRY_SIZE;
-	return le_off;
-}
-
 static inline uint16_t next_gen_id(uint16_t gen_id)
 {
 	gen_id++;
@@ -80,250 +84,328 @@ static inline uint16_t prev_gen_id(uint16_t gen_id)
 	return gen_id;
 }
 
-/* Undo a valid log entry */
-static inline void pmfs_undo_logentry(struct super_block *sb,
-	pmfs_logentry_t *le)
+/* never 0, so that a cleared checksum never matches */
+static inline u32 pmfs_logrec_csum(pmfs_logrec_t *rec, uint16_t gen_id)
 {
-	char *data;
+	u32 csum = crc32c(gen_id, &rec->size,
+		le16_to_cpu(rec->size) - sizeof(rec->csum));
+
+	return csum ? csum : 1;
+}
 
-	if (le->size > 0) {
-		data = pmfs_get_block(sb, le64_to_cpu(le->addr_offset));
-		/* Undo changes by flushing the log entry to pmfs */
-		pmfs_memunlock_range(sb, data, le->size);
-		memcpy(data, le->data, le->size);
-		pmfs_memlock_range(sb, data, le->size);
-		pmfs_flush_buffer(data, le->size, false);
+/* returns the record at offset off of a lane if it is valid for gen_id.
+ * Valid records never extend past end. */
+static pmfs_logrec_t *pmfs_get_logrec(struct pmfs_journal_lane *lane,
+		uint32_t off, uint32_t end, uint16_t gen_id)
+{
+	pmfs_logrec_t *rec = lane->base_addr + off;
+	pmfs_logrange_t *lr = (pmfs_logrange_t *)(rec + 1);
+	uint32_t size = le16_to_cpu(rec->size);
+	uint32_t len;
+	int i;
+
+	if (size < sizeof(*rec) || size > end - off ||
+			size & (PMFS_LOGREC_ALIGN - 1))
+		return NULL;
+	if (le32_to_cpu(rec->csum) != pmfs_logrec_csum(rec, gen_id))
+		return NULL;
+	/* the ranges must fit too */
+	len = sizeof(*rec) + rec->nr_ranges * sizeof(*lr);
+	for (i = 0; i < rec->nr_ranges && len <= size; i++)
+		len += le64_to_cpu(lr[i].off_len) >> PMFS_LOGRANGE_SHIFT;
+	return len <= size ? rec : NULL;
+}
+
+/* records of a lane starting at head never cross the tail or wrap */
+static inline uint32_t pmfs_log_end(struct pmfs_journal_lane *lane,
+		uint32_t head, uint32_t tail)
+{
+	return head < tail ? tail : lane->jsize;
+}
+
+/* Copies the logged contents of every range of rec back to its location
+ * if copy is set, and flushes the locations. */
+static void pmfs_logrec_writeback(struct super_block *sb,
+		pmfs_logrec_t *rec, bool copy)
+{
+	pmfs_logrange_t *lr = (pmfs_logrange_t *)(rec + 1);
+	char *data = (char *)(lr + rec->nr_ranges);
+	u64 off_len;
+	uint16_t len;
+	char *addr;
+	int i;
+
+	for (i = 0; i < rec->nr_ranges; i++) {
+		off_len = le64_to_cpu(lr[i].off_len);
+		len = off_len >> PMFS_LOGRANGE_SHIFT;
+		addr = pmfs_get_block(sb, off_len & PMFS_LOGRANGE_OFF_MASK);
+		if (copy) {
+			pmfs_memunlock_range(sb, addr, len);
+			memcpy(addr, data, len);
+			pmfs_memlock_range(sb, addr, len);
+		}
+		pmfs_flush_buffer(addr, len, false);
+		data += len;
 	}
 }
 
+static inline bool pmfs_is_undo_logrec(pmfs_logrec_t *rec)
+{
+	return rec->nr_ranges && !(rec->type & LE_REDO);
+}
+
 /* can be called during journal recovery or transaction abort */
-/* We need to Undo in the reverse order */
+/* We need to Undo in the reverse order. Records can only be walked
+ * forward, so every step starts over from the first one; transactions
+ * hold a handful of records and this is not a fast path. */
 static void pmfs_undo_transaction(struct super_block *sb,
 		pmfs_transaction_t *trans)
 {
-	pmfs_logentry_t *le;
+	pmfs_logrec_t *rec;
+	int i, n = 0;
+
+	for_each_logrec(rec, trans)
+		n++;
+	while (n-- > 0) {
+		i = 0;
+		for_each_logrec(rec, trans)
+			if (i++ == n)
+				break;
+		if (pmfs_is_undo_logrec(rec))
+			pmfs_logrec_writeback(sb, rec, true);
+	}
+}
+
+/* Adds lines [first, last] to the dirty set of trans, merged with every
+ * range it overlaps or touches. Returns false if the set is full. */
+static bool pmfs_add_dirty_lines(pmfs_transaction_t *trans,
+		unsigned long first, unsigned long last)
+{
+	struct pmfs_dirty_lines *d;
 	int i;
-	uint16_t gen_id = trans->gen_id;
 
-	le = trans->start_addr + trans->num_used;
-	le--;
-	for (i = trans->num_used - 1; i >= 0; i--, le--) {
-		if (gen_id == le16_to_cpu(le->gen_id))
-			pmfs_undo_logentry(sb, le);
+again:
+	for (i = 0; i < trans->nr_dirty; i++) {
+		d = &trans->dirty[i];
+		if (first > d->last + 1 || last + 1 < d->first)
+			continue;
+		/* the union may touch another range now, so start over */
+		first = min(first, d->first);
+		last = max(last, d->last);
+		trans->dirty[i] = trans->dirty[--trans->nr_dirty];
+		goto again;
 	}
+	if (trans->nr_dirty == PMFS_DIRTY_RANGES)
+		return false;
+	d = &trans->dirty[trans->nr_dirty++];
+	d->first = first;
+	d->last = last;
+	return true;
 }
 
-/* can be called by either during log cleaning or during journal recovery */
-static void pmfs_flush_transaction(struct super_block *sb,
+static void __pmfs_dirty_range(pmfs_transaction_t *trans, void *addr,
+		uint32_t len)
+{
+	unsigned long first = (unsigned long)addr / CACHELINE_SIZE;
+	unsigned long last = ((unsigned long)addr + max(len, 1U) - 1) /
+		CACHELINE_SIZE;
+
+	if (!pmfs_add_dirty_lines(trans, first, last)) {
+		pmfs_flush_buffer(addr, len, false);
+		trans->flushed += last - first + 1;
+	}
+}
+
+/* Records an in-place update of [addr, addr + len) to be flushed when the
+ * running transaction commits, once however many times its lines are
+ * dirtied. Outside a transaction, the update is flushed right away. */
+void pmfs_dirty_range(struct super_block *sb, void *addr, uint32_t len)
+{
+	pmfs_transaction_t *trans = current->journal_info;
+
+	if (trans)
+		__pmfs_dirty_range(trans, addr, len);
+	else
+		pmfs_flush_buffer(addr, len, false);
+}
+
+/* flushes the dirty set of trans, and counts the lines it flushed */
+static void pmfs_flush_dirty(struct super_block *sb,
 		pmfs_transaction_t *trans)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
-	pmfs_logentry_t *le = trans->start_addr;
+	struct pmfs_dirty_lines *d;
+	unsigned long lines = trans->flushed;
+	int i, bucket;
+
+	for (i = 0; i < trans->nr_dirty; i++) {
+		d = &trans->dirty[i];
+		pmfs_flush_buffer((void *)(d->first * CACHELINE_SIZE),
+			(d->last - d->first + 1) * CACHELINE_SIZE, false);
+		lines += d->last - d->first + 1;
+	}
+	trans->nr_dirty = 0;
+	trans->flushed = 0;
+	if (!sbi->flush_stats)
+		return;
+	bucket = lines ? ilog2(lines) + 1 : 0;
+	this_cpu_add(sbi->flush_stats->lines, lines);
+	this_cpu_inc(sbi->flush_stats->per_trans[min(bucket,
+		PMFS_FLUSH_BUCKETS - 1)]);
+}
+
+/* Flushes the in-place updates of an undo log transaction at commit: the
+ * logged ranges and whatever else was dirtied, each line once. */
+static void pmfs_flush_transaction(struct super_block *sb,
+		pmfs_transaction_t *trans)
+{
+	pmfs_logrec_t *rec;
+	pmfs_logrange_t *lr;
+	u64 off_len;
 	int i;
-	char *data;
 
-	for (i = 0; i < trans->num_used; i++, le++) {
-		if (le->size) {
-			data = pmfs_get_block(sb,le64_to_cpu(le->addr_offset));
-			if (sbi->redo_log) {
-				pmfs_memunlock_range(sb, data, le->size);
-				memcpy(data, le->data, le->size);
-				pmfs_memlock_range(sb, data, le->size);
-			} else
-				pmfs_flush_buffer(data, le->size, false);
+	for_each_logrec(rec, trans) {
+		if (!pmfs_is_undo_logrec(rec))
+			continue;
+		lr = (pmfs_logrange_t *)(rec + 1);
+		for (i = 0; i < rec->nr_ranges; i++) {
+			off_len = le64_to_cpu(lr[i].off_len);
+			__pmfs_dirty_range(trans, pmfs_get_block(sb,
+				off_len & PMFS_LOGRANGE_OFF_MASK),
+				off_len >> PMFS_LOGRANGE_SHIFT);
 		}
 	}
+	pmfs_flush_dirty(sb, trans);
 }
 
-static inline void invalidate_gen_id(pmfs_logentry_t *le)
+static inline void invalidate_logrec(pmfs_logrec_t *rec)
 {
-	le->gen_id = 0;
-	pmfs_flush_buffer(le, LOGENTRY_SIZE, false);
+	rec->csum = 0;
+	pmfs_flush_buffer(&rec->csum, sizeof(rec->csum), false);
 }
 
 /* can be called by either during log cleaning or during journal recovery */
 static void pmfs_invalidate_logentries(struct super_block *sb,
 		pmfs_transaction_t *trans)
 {
-	pmfs_logentry_t *le = trans->start_addr;
-	int i;
+	pmfs_logrec_t *rec;
 
-	pmfs_memunlock_range(sb, trans->start_addr,
-			trans->num_entries * LOGENTRY_SIZE);
-	for (i = 0; i < trans->num_entries; i++) {
-		invalidate_gen_id(le);
-		if (le->type == LE_START) {
+	pmfs_memunlock_log(sb, trans->start_addr, trans->used);
+	for_each_logrec(rec, trans) {
+		invalidate_logrec(rec);
+		if (rec->type & LE_START) {
 			PERSISTENT_MARK();
 			PERSISTENT_BARRIER();
 		}
-		le++;
 	}
-	pmfs_memlock_range(sb, trans->start_addr,
-			trans->num_entries * LOGENTRY_SIZE);
+	pmfs_memlock_range(sb, trans->start_addr, trans->used);
 }
 
 /* can be called by either during log cleaning or during journal recovery */
 static void pmfs_redo_transaction(struct super_block *sb,
 		pmfs_transaction_t *trans, bool recover)
 {
-	pmfs_logentry_t *le = trans->start_addr;
-	int i;
-	uint16_t gen_id = trans->gen_id;
-	char *data;
+	pmfs_logrec_t *rec;
 
-	for (i = 0; i < trans->num_entries; i++) {
-		if (gen_id == le16_to_cpu(le->gen_id) && le->size > 0) {
-			data = pmfs_get_block(sb,le64_to_cpu(le->addr_offset));
-			/* flush data if we are called during recovery */
-			if (recover) {
-				pmfs_memunlock_range(sb, data, le->size);
-				memcpy(data, le->data, le->size);
-				pmfs_memlock_range(sb, data, le->size);
-			}
-			pmfs_flush_buffer(data, le->size, false);
-		}
-		le++;
-	}
+	/* copy the data only if we are called during recovery */
+	for_each_logrec(rec, trans)
+		if (rec->type & LE_REDO)
+			pmfs_logrec_writeback(sb, rec, recover);
 }
 
-/* recover the transaction ending at a valid log entry *le */
-/* called for Undo log and traverses the journal backward */
-static uint32_t pmfs_recover_transaction(struct super_block *sb, uint32_t head,
-		uint32_t tail, pmfs_logentry_t *le)
+/* Finds the records of the transaction whose LE_START record is at offset
+ * head, up to its commit or abort record or the first record that is not
+ * valid. Fills in *trans, and the commit sequence of a committed redo log
+ * transaction in *seq. Returns the offset of the log entry after the last
+ * valid record. */
+static uint32_t pmfs_scan_transaction(struct pmfs_journal_lane *lane,
+		uint32_t head, uint32_t tail, uint16_t gen_id,
+		pmfs_transaction_t *trans, u64 *seq)
 {
-	struct pmfs_sb_info *sbi = PMFS_SB(sb);
-	pmfs_transaction_t trans;
-	bool cmt_or_abrt_found = false, start_found = false;
-	uint16_t gen_id = le16_to_cpu(le->gen_id);
-
-	memset(&trans, 0, sizeof(trans));
-	trans.transaction_id = le32_to_cpu(le->transaction_id);
-	trans.gen_id = gen_id;
-
-	do {
-		trans.num_entries++;
-		trans.num_used++;
-
-		if (gen_id == le16_to_cpu(le->gen_id)) {
-			/* Handle committed/aborted transactions */
-			if (le->type & LE_COMMIT || le->type & LE_ABORT)
-				cmt_or_abrt_found = true;
-			if (le->type & LE_START) {
-				trans.start_addr = le;
-				start_found = true;
-				break;
-			}
+	uint32_t end = pmfs_log_end(lane, head, tail);
+	uint32_t off = head;
+	pmfs_logrec_t *rec;
+
+	memset(trans, 0, sizeof(*trans));
+	trans->start_addr = lane->base_addr + head;
+	trans->gen_id = gen_id;
+	trans->status = TRANS_RUNNING;
+	while (off < end) {
+		rec = pmfs_get_logrec(lane, off, end, gen_id);
+		/* a new transaction started before this one committed */
+		if (!rec || (off != head && (rec->type & LE_START)))
+			break;
+		off += le16_to_cpu(rec->size);
+		if (rec->type & LE_COMMIT) {
+			trans->status = TRANS_COMMITTED;
+			if (seq && le16_to_cpu(rec->size) >= sizeof(*rec) +
+					sizeof(__le64))
+				*seq = le64_to_cpup((__le64 *)(rec + 1));
+			break;
 		}
-		if (tail == 0 || tail == head)
-		    break;
-		/* prev log entry */
-		le--;
-		/* Handle uncommitted transactions */
-		if ((gen_id == le16_to_cpu(le->gen_id))
-			&& (le->type & LE_COMMIT || le->type & LE_ABORT)) {
-			BUG_ON(trans.transaction_id == 
-				le32_to_cpu(le->transaction_id));
-			le++;
+		if (rec->type & LE_ABORT) {
+			trans->status = TRANS_ABORTED;
 			break;
 		}
-		tail = prev_log_entry(sbi->jsize, tail);
-	} while (1);
+	}
+	trans->used = off - head;
+	trans->size = ALIGN(trans->used, LOGENTRY_SIZE);
+	off = head + trans->size;
+	return off >= lane->jsize ? 0 : off;
+}
 
-	if (start_found && !cmt_or_abrt_found)
-		pmfs_undo_transaction(sb, &trans);
+/* process the transaction starting at a valid LE_START record at head */
+/* called by the log cleaner; stops at a transaction that is running */
+static uint32_t pmfs_process_transaction(struct super_block *sb,
+		struct pmfs_journal_lane *lane, uint32_t head, uint32_t tail,
+		uint16_t gen_id)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	pmfs_transaction_t trans;
+	uint32_t new_head;
+
+	new_head = pmfs_scan_transaction(lane, head, tail, gen_id, &trans,
+		NULL);
+	if (trans.status == TRANS_RUNNING) {
+		pmfs_dbg_trans("no cmt sa %p used %x gen %d\n",
+			trans.start_addr, trans.used, trans.gen_id);
+		return head;
+	}
+	if (trans.status == TRANS_COMMITTED && sbi->redo_log)
+		pmfs_redo_transaction(sb, &trans, false);
 
 	if (gen_id == MAX_GEN_ID) {
-		if (!start_found)
-			trans.start_addr = le;
-		/* make sure the changes made by pmfs_undo_transaction() are
-		 * persistent before invalidating the log entries */
-		if (start_found && !cmt_or_abrt_found) {
+		if (trans.status == TRANS_COMMITTED && sbi->redo_log) {
 			PERSISTENT_MARK();
 			PERSISTENT_BARRIER();
 		}
 		pmfs_invalidate_logentries(sb, &trans);
 	}
-	return tail;
+	return new_head;
 }
 
-/* process the transaction starting at a valid log entry *le */
-/* called by the log cleaner and journal recovery */
-static uint32_t pmfs_process_transaction(struct super_block *sb, uint32_t head,
-		uint32_t tail, pmfs_logentry_t *le, bool recover)
+/* wakes up tasks waiting for log space in pmfs_free_logentries() */
+static inline void pmfs_wake_journal_waiters(struct pmfs_sb_info *sbi)
 {
-	struct pmfs_sb_info *sbi = PMFS_SB(sb);
-	pmfs_transaction_t trans;
-	uint16_t gen_id;
-	uint32_t new_head = head;
-
-	gen_id = le16_to_cpu(le->gen_id);
-	if (!(le->type & LE_START)) {
-		pmfs_dbg("start of trans %x but LE_START not set. gen_id %d\n",
-				le32_to_cpu(le->transaction_id), gen_id);
-		return next_log_entry(sbi->jsize, new_head);
-	}
-	memset(&trans, 0, sizeof(trans));
-	trans.transaction_id = le32_to_cpu(le->transaction_id);
-	trans.start_addr = le;
-	trans.gen_id = gen_id;
-	do {
-		trans.num_entries++;
-		trans.num_used++;
-		new_head = next_log_entry(sbi->jsize, new_head);
-
-		/* Handle committed/aborted transactions */
-		if ((gen_id == le16_to_cpu(le->gen_id)) && (le->type & LE_COMMIT
-					|| le->type & LE_ABORT)) {
-			head = new_head;
-			if ((le->type & LE_COMMIT) && sbi->redo_log)
-				pmfs_redo_transaction(sb, &trans, recover);
-
-			if (gen_id == MAX_GEN_ID) {
-				if ((le->type & LE_COMMIT) && sbi->redo_log) {
-					PERSISTENT_MARK();
-					PERSISTENT_BARRIER();
-				}
-				pmfs_invalidate_logentries(sb, &trans);
-			}
-			break;
-		}
-		/* next log entry */
-		le++;
-		/* Handle uncommitted transactions */
-		if ((new_head == tail) || ((gen_id == le16_to_cpu(le->gen_id))
-			    && (le->type & LE_START))) {
-			/* found a new valid transaction w/o finding a commit */
-			if (recover) {
-				/* if this function is called by recovery, move
-				 * ahead even if we didn't find a commit record
-				 * for this transaction */
-				head = new_head;
-				if (gen_id == MAX_GEN_ID)
-					pmfs_invalidate_logentries(sb, &trans);
-			}
-			pmfs_dbg_trans("no cmt tid %d sa %p nle %d tail %x"
-			" gen %d\n",
-			trans.transaction_id,trans.start_addr,trans.num_entries,
-			trans.num_used, trans.gen_id);
-			/* dump_transaction(sbi, &trans); */
-			break;
-		}
-	} while (new_head != tail);
-
-	return head;
+	if (waitqueue_active(&sbi->journal_space_wait))
+		wake_up(&sbi->journal_space_wait);
 }
 
-static void pmfs_clean_journal(struct super_block *sb, bool unmount)
+/* called by the log cleaner thread, and by transactions that ran out of
+ * log space. lane->clean_lock serializes them. */
+static void pmfs_clean_journal(struct super_block *sb,
+		struct pmfs_journal_lane *lane, bool unmount)
 {
-	struct pmfs_sb_info *sbi = PMFS_SB(sb);
-	pmfs_journal_t *journal = pmfs_get_journal(sb);
-	uint32_t head = le32_to_cpu(journal->head);
-	uint32_t new_head, tail;
+	pmfs_journal_t *journal = lane->journal;
+	uint32_t head, new_head, tail;
 	uint16_t gen_id;
 	volatile __le64 *ptr_tail_genid = (volatile __le64 *)&journal->tail;
 	u64 tail_genid;
-	pmfs_logentry_t *le;
+	pmfs_logrec_t *rec;
+	bool reserving;
 
+	mutex_lock(&lane->clean_lock);
+	head = le32_to_cpu(journal->head);
 	/* atomically read both tail and gen_id of journal. Normally use of
 	 * volatile is prohibited in kernel code but since we use volatile
 	 * to write to journal's tail and gen_id atomically, we thought we
@@ -332,28 +414,39 @@ static void pmfs_clean_journal(struct super_block *sb, bool unmount)
 	tail_genid = le64_to_cpu(*ptr_tail_genid);
 	tail = tail_genid & 0xFFFFFFFF;
 	gen_id = (tail_genid >> 32) & 0xFFFF;
+	/* Space below tail whose start record is not visible yet looks
+	 * like the unused space the cleaner skips. Every reservation below
+	 * tail counted itself before its cmpxchg, so if none is counted now
+	 * all their start records can be seen; otherwise the cleaner stops
+	 * at the first slot without a valid record. */
+	smp_mb();
+	reserving = atomic_read(&lane->nr_reserving) != 0;
 
 	/* journal wraparound happened. so head points to prev generation id */
 	if (tail < head)
 		gen_id = prev_gen_id(gen_id);
 	pmfs_dbg_trans("starting journal cleaning %x %x\n", head, tail);
 	while (head != tail) {
-		le = (pmfs_logentry_t *)(sbi->journal_base_addr + head);
-		if (gen_id == le16_to_cpu(le->gen_id)) {
-			/* found a valid log entry, process the transaction */
-			new_head = pmfs_process_transaction(sb, head, tail,
-				le, false);
+		rec = pmfs_get_logrec(lane, head,
+			pmfs_log_end(lane, head, tail), gen_id);
+		if (rec && (rec->type & LE_START)) {
+			/* found a valid transaction, process it */
+			new_head = pmfs_process_transaction(sb, lane, head,
+				tail, gen_id);
 			/* no progress was made. return */
 			if (new_head == head)
 				break;
 			head = new_head;
 		} else {
+			if (reserving)
+				break;
+			rec = lane->base_addr + head;
 			if (gen_id == MAX_GEN_ID) {
-				pmfs_memunlock_range(sb, le, sizeof(*le));
-				invalidate_gen_id(le);
-				pmfs_memlock_range(sb, le, sizeof(*le));
+				pmfs_memunlock_log(sb, rec, sizeof(*rec));
+				invalidate_logrec(rec);
+				pmfs_memlock_range(sb, rec, sizeof(*rec));
 			}
-			head = next_log_entry(sbi->jsize, head);
+			head = next_log_entry(lane->jsize, head);
 		}
 		/* handle journal wraparound */
 		if (head == 0)
@@ -361,7 +454,7 @@ static void pmfs_clean_journal(struct super_block *sb, bool unmount)
 	}
 	PERSISTENT_MARK();
 	PERSISTENT_BARRIER();
-	pmfs_memunlock_range(sb, journal, sizeof(*journal));
+	pmfs_memunlock_log(sb, journal, sizeof(*journal));
 	journal->head = cpu_to_le32(head);
 	pmfs_memlock_range(sb, journal, sizeof(*journal));
 	pmfs_flush_buffer(&journal->head, sizeof(journal->head), true);
@@ -372,63 +465,308 @@ static void pmfs_clean_journal(struct super_block *sb, bool unmount)
 			le32_to_cpu(journal->head), le32_to_cpu(journal->tail));
 		PERSISTENT_BARRIER();
 	}
+	mutex_unlock(&lane->clean_lock);
+	pmfs_wake_journal_waiters(PMFS_SB(sb));
 	pmfs_dbg_trans("leaving journal cleaning %x %x\n", head, tail);
 }
 
-static void log_cleaner_try_sleeping(struct  pmfs_sb_info *sbi)
+/* The cleaner of a lane runs on a CPU that uses the lane, which also
+ * keeps it on the lane's NUMA node. */
+static int pmfs_lane_cpu(struct pmfs_sb_info *sbi,
+		struct pmfs_journal_lane *lane)
 {
-	DEFINE_WAIT(wait);
-	prepare_to_wait(&sbi->log_cleaner_wait, &wait, TASK_INTERRUPTIBLE);
-	schedule();
-	finish_wait(&sbi->log_cleaner_wait, &wait);
+	unsigned int i = lane - sbi->lanes;
+	int cpu;
+
+	for_each_online_cpu(cpu)
+		if (cpu % sbi->num_lanes == i)
+			return cpu;
+	return WORK_CPU_UNBOUND;
 }
 
-static int pmfs_log_cleaner(void *arg)
+/* Cleans a lane and schedules the next run from how fast the lane fills:
+ * about when another eighth of it will have been reserved. The fill rate
+ * is measured from how far the tail moved since the last run. A lane that
+ * stayed empty is left alone until a reservation kicks it again. */
+static void pmfs_clean_lane_work(struct work_struct *work)
 {
-	struct super_block *sb = (struct super_block *)arg;
+	struct pmfs_journal_lane *lane = container_of(to_delayed_work(work),
+		struct pmfs_journal_lane, clean_work);
+	struct super_block *sb = lane->sb;
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	volatile __le64 *ptr_tail_genid = (volatile __le64 *)
+		&lane->journal->tail;
+	unsigned long now = jiffies, delay;
+	uint32_t tail, filled, before, after;
+	uint16_t gen_id;
+	u64 tail_genid;
 
-	pmfs_dbg_trans("Running log cleaner thread\n");
-	for ( ; ; ) {
-		log_cleaner_try_sleeping(sbi);
+	clear_bit(0, &lane->clean_kicked);
 
-		if (kthread_should_stop())
-			break;
+	tail_genid = le64_to_cpu(*ptr_tail_genid);
+	tail = tail_genid & 0xFFFFFFFF;
+	gen_id = (tail_genid >> 32) & 0xFFFF;
+	/* undercounts if the lane wrapped more than once, which only
+	 * happens while writers are reclaiming the log themselves */
+	if (gen_id == lane->clean_gen_id)
+		filled = tail - lane->clean_tail;
+	else
+		filled = lane->jsize - lane->clean_tail + tail;
+	lane->fill_rate = (3 * lane->fill_rate + (u64)filled * HZ /
+		max(now - lane->clean_last, 1UL)) / 4;
+	lane->clean_tail = tail;
+	lane->clean_gen_id = gen_id;
+	lane->clean_last = now;
+
+	before = pmfs_lane_used(lane);
+	pmfs_clean_journal(sb, lane, false);
+	after = pmfs_lane_used(lane);
+	lane->nr_cleans++;
+	lane->max_lag = max(lane->max_lag, before);
+	if (before > after)
+		lane->bytes_cleaned += before - after;
+
+	if (!after && !filled)
+		return;
+	/* a running transaction holds the log: ignore kicks until the
+	 * timer runs again */
+	if (after && after >= before)
+		set_bit(0, &lane->clean_kicked);
+	delay = lane->fill_rate ? (u64)(lane->jsize >> 3) * HZ /
+		lane->fill_rate : PMFS_CLEAN_MAX_DELAY;
+	delay = clamp_t(unsigned long, delay, PMFS_CLEAN_MIN_DELAY,
+		PMFS_CLEAN_MAX_DELAY);
+	queue_delayed_work_on(pmfs_lane_cpu(sbi, lane), sbi->clean_wq,
+		&lane->clean_work, delay);
+}
 
-		pmfs_clean_journal(sb, false);
-	}
-	pmfs_clean_journal(sb, true);
-	pmfs_dbg_trans("Exiting log cleaner thread\n");
-	return 0;
+/* called when a reservation leaves a lane more than an eighth full */
+static void pmfs_kick_cleaner(struct pmfs_sb_info *sbi,
+		struct pmfs_journal_lane *lane)
+{
+	if (test_bit(0, &lane->clean_kicked) ||
+	    test_and_set_bit(0, &lane->clean_kicked))
+		return;
+	pmfs_dbg_trans("kicking the cleaner of lane %ld\n",
+		(long)(lane - sbi->lanes));
+	mod_delayed_work_on(pmfs_lane_cpu(sbi, lane), sbi->clean_wq,
+		&lane->clean_work, 0);
 }
 
-static int pmfs_journal_cleaner_run(struct super_block *sb)
+static struct workqueue_struct *pmfs_journal_cleaner_alloc(
+		struct super_block *sb)
 {
-	int ret = 0;
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
 
-	init_waitqueue_head(&sbi->log_cleaner_wait);
+	return alloc_workqueue("pmfs_log_cleaner_0x%llx", WQ_MEM_RECLAIM, 0,
+		(u64)sbi->phys_addr);
+}
+
+/* Hands the lanes to the cleaner running on wq. It cannot fail, so that a
+ * resize that gives up can always put the old lanes back. */
+static void pmfs_journal_cleaner_start(struct pmfs_sb_info *sbi,
+		struct workqueue_struct *wq)
+{
+	struct pmfs_journal_lane *lane;
+	unsigned int i;
+
+	sbi->clean_wq = wq;
+	for (i = 0; i < sbi->num_lanes; i++) {
+		lane = &sbi->lanes[i];
+		INIT_DELAYED_WORK(&lane->clean_work, pmfs_clean_lane_work);
+		lane->clean_last = jiffies;
+		lane->clean_tail = le32_to_cpu(lane->journal->tail);
+		lane->clean_gen_id = le16_to_cpu(lane->journal->gen_id);
+	}
+}
+
+static void pmfs_journal_cleaner_stop(struct pmfs_sb_info *sbi)
+{
+	unsigned int i;
+
+	if (!sbi->clean_wq)
+		return;
+	for (i = 0; i < sbi->num_lanes; i++)
+		cancel_delayed_work_sync(&sbi->lanes[i].clean_work);
+	destroy_workqueue(sbi->clean_wq);
+	sbi->clean_wq = NULL;
+}
+
+static int pmfs_journal_cleaner_run(struct super_block *sb)
+{
+	struct workqueue_struct *wq = pmfs_journal_cleaner_alloc(sb);
 
-	sbi->log_cleaner_thread = kthread_run(pmfs_log_cleaner, sb,
-			"pmfs_log_cleaner_0x%llx", sbi->phys_addr);
-	if (IS_ERR(sbi->log_cleaner_thread)) {
+	if (!wq) {
 		/* failure at boot is fatal */
-		pmfs_err(sb, "Failed to start pmfs log cleaner thread\n");
-		ret = -1;
+		pmfs_err(sb, "Failed to start pmfs log cleaner\n");
+		return -ENOMEM;
+	}
+	pmfs_journal_cleaner_start(PMFS_SB(sb), wq);
+	return 0;
+}
+
+static inline pmfs_journal_t *pmfs_lane_header(void *area, unsigned int i)
+{
+	return (pmfs_journal_t *)(area + i * CACHELINE_SIZE);
+}
+
+/* One lane per CPU, as long as each lane gets at least PMFS_MIN_LANE_SIZE.
+ * A redo log keeps a single lane: lanes are cleaned independently, so a
+ * lane could still hold a committed transaction after a newer one that
+ * updated the same data was cleaned from another, and recovery would roll
+ * the stale values forward. */
+static unsigned int pmfs_journal_nr_lanes(uint32_t size, __le16 redo_logging)
+{
+	unsigned int nr;
+
+	if (le16_to_cpu(redo_logging))
+		return 1;
+	nr = min_t(unsigned int, num_possible_cpus(), PMFS_MAX_LANES);
+	nr = min_t(unsigned int, nr,
+		(size - PMFS_LANE_HDR_SIZE) / PMFS_MIN_LANE_SIZE);
+	return max(nr, 1U);
+}
+
+/* Clears size bytes of log at base and lays out the lanes behind their
+ * headers. Returns the number of lanes. */
+static unsigned int pmfs_format_area(struct super_block *sb, uint64_t base,
+		uint32_t size, __le16 redo_logging)
+{
+	unsigned int i, nr = pmfs_journal_nr_lanes(size, redo_logging);
+	uint32_t lane_size;
+	void *area = pmfs_get_block(sb, base);
+	pmfs_journal_t *lj;
+
+	lane_size = (size - PMFS_LANE_HDR_SIZE) / nr;
+	lane_size &= ~(PMFS_DEF_BLOCK_SIZE_4K - 1);
+
+	pmfs_memunlock_log(sb, area, size);
+	memset_nt(area, 0, size);
+	for (i = 0; i < nr; i++) {
+		lj = pmfs_lane_header(area, i);
+		lj->base = cpu_to_le64(base + PMFS_LANE_HDR_SIZE +
+			(uint64_t)i * lane_size);
+		lj->size = cpu_to_le32(lane_size);
+		lj->gen_id = cpu_to_le16(1);
+		lj->redo_logging = redo_logging;
+	}
+	pmfs_memlock_range(sb, area, size);
+	pmfs_flush_buffer(area, nr * CACHELINE_SIZE, false);
+	PERSISTENT_MARK();
+	PERSISTENT_BARRIER();
+	return nr;
+}
+
+/* Formats the journal area in place. The lanes only become visible once
+ * num_lanes is persistent in the journal header, so a crash in here leaves
+ * an empty single log behind. Lanes that are already there are hidden the
+ * same way before their headers are overwritten. Returns the number of
+ * lanes. */
+static unsigned int pmfs_format_lanes(struct super_block *sb,
+		pmfs_journal_t *journal)
+{
+	unsigned int nr;
+
+	if (journal->num_lanes) {
+		pmfs_memunlock_log(sb, journal, sizeof(*journal));
+		journal->num_lanes = 0;
+		pmfs_memlock_range(sb, journal, sizeof(*journal));
+		pmfs_flush_buffer(&journal->num_lanes,
+			sizeof(journal->num_lanes), false);
+		PERSISTENT_MARK();
+		PERSISTENT_BARRIER();
+	}
+	nr = pmfs_format_area(sb, le64_to_cpu(journal->base),
+		le32_to_cpu(journal->size), journal->redo_logging);
+
+	/* an empty log is empty in either format, so the order of these two
+	 * does not matter */
+	pmfs_memunlock_log(sb, journal, sizeof(*journal));
+	journal->log_format = cpu_to_le16(PMFS_LOG_FORMAT_PACKED);
+	journal->num_lanes = cpu_to_le16(nr);
+	pmfs_memlock_range(sb, journal, sizeof(*journal));
+	pmfs_flush_buffer(journal, sizeof(*journal), true);
+	return nr;
+}
+
+/* Points lanes at the nr lane headers that start the journal area. nr == 0
+ * is an old image, whose journal header itself describes a single log. */
+static void pmfs_journal_init_lanes(struct super_block *sb,
+		struct pmfs_journal_lane *lanes, pmfs_journal_t *journal,
+		void *area, unsigned int nr)
+{
+	struct pmfs_journal_lane *lane;
+	unsigned int i;
+
+	if (nr == 0) {
+		lanes[0].journal = journal;
+		nr = 1;
+	} else {
+		for (i = 0; i < nr; i++)
+			lanes[i].journal = pmfs_lane_header(area, i);
+	}
+	for (i = 0; i < nr; i++) {
+		lane = &lanes[i];
+		lane->sb = sb;
+		lane->base_addr = pmfs_get_block(sb,
+			le64_to_cpu(lane->journal->base));
+		lane->jsize = le32_to_cpu(lane->journal->size);
+		mutex_init(&lane->clean_lock);
+		atomic_set(&lane->nr_reserving, 0);
 	}
-	return ret;
+}
+
+static struct pmfs_journal_lane *pmfs_journal_alloc_lanes(
+		struct super_block *sb, pmfs_journal_t *journal, void *area,
+		unsigned int nr)
+{
+	struct pmfs_journal_lane *lanes;
+
+	lanes = kcalloc(max(nr, 1U), sizeof(*lanes), GFP_KERNEL);
+	if (lanes)
+		pmfs_journal_init_lanes(sb, lanes, journal, area, nr);
+	return lanes;
+}
+
+static int pmfs_journal_setup_lanes(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	pmfs_journal_t *journal = pmfs_get_journal(sb);
+	unsigned int nr = le16_to_cpu(journal->num_lanes);
+	void *area = pmfs_get_block(sb, le64_to_cpu(journal->base));
+	struct pmfs_journal_lane *lanes;
+
+	if (nr > PMFS_MAX_LANES) {
+		pmfs_err(sb, "journal has %u lanes, at most %d supported\n",
+			nr, PMFS_MAX_LANES);
+		return -EINVAL;
+	}
+	lanes = pmfs_journal_alloc_lanes(sb, journal, area, nr);
+	if (!lanes)
+		return -ENOMEM;
+	kfree(sbi->lanes);
+	sbi->lanes = lanes;
+	sbi->num_lanes = max(nr, 1U);
+	return 0;
 }
 
 int pmfs_journal_soft_init(struct super_block *sb)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
 	pmfs_journal_t *journal = pmfs_get_journal(sb);
+	int ret;
 
-	sbi->next_transaction_id = 0;
-	sbi->journal_base_addr = pmfs_get_block(sb,le64_to_cpu(journal->base));
 	sbi->jsize = le32_to_cpu(journal->size);
-	mutex_init(&sbi->journal_mutex);
 	sbi->redo_log = !!le16_to_cpu(journal->redo_logging);
+	atomic64_set(&sbi->commit_seq, 0);
+	init_waitqueue_head(&sbi->journal_space_wait);
+	spin_lock_init(&sbi->commit_lock);
+	INIT_LIST_HEAD(&sbi->commit_pending);
+	sbi->commit_nr_pending = 0;
+	sbi->commit_leader = false;
+	ret = pmfs_journal_setup_lanes(sb);
+	if (ret)
+		return ret;
 
 	return pmfs_journal_cleaner_run(sb);
 }
@@ -436,40 +774,231 @@ int pmfs_journal_soft_init(struct super_block *sb)
 int pmfs_journal_hard_init(struct super_block *sb, uint64_t base,
 	uint32_t size)
 {
-	struct pmfs_sb_info *sbi = PMFS_SB(sb);
 	pmfs_journal_t *journal = pmfs_get_journal(sb);
 
-	pmfs_memunlock_range(sb, journal, sizeof(*journal));
+	pmfs_memunlock_log(sb, journal, sizeof(*journal));
 	journal->base = cpu_to_le64(base);
 	journal->size = cpu_to_le32(size);
 	journal->gen_id = cpu_to_le16(1);
 	journal->head = journal->tail = 0;
-	/* lets do Undo logging for now */
-	journal->redo_logging = 0;
+	journal->num_lanes = 0;
+	journal->redo_logging = cpu_to_le16(test_opt(sb, REDO_LOG) ? 1 : 0);
 	pmfs_memlock_range(sb, journal, sizeof(*journal));
 
-	sbi->journal_base_addr = pmfs_get_block(sb, base);
-	pmfs_memunlock_range(sb, sbi->journal_base_addr, size);
-	memset_nt(sbi->journal_base_addr, 0, size);
-	pmfs_memlock_range(sb, sbi->journal_base_addr, size);
+	pmfs_format_lanes(sb, journal);
 
 	return pmfs_journal_soft_init(sb);
 }
 
-static void wakeup_log_cleaner(struct pmfs_sb_info *sbi)
+/* true if the journal predates packed records or lanes, or is a redo log
+ * split into lanes */
+static bool pmfs_journal_outdated(struct super_block *sb)
 {
-	if (!waitqueue_active(&sbi->log_cleaner_wait))
-		return;
-	pmfs_dbg_trans("waking up the cleaner thread\n");
-	wake_up_interruptible(&sbi->log_cleaner_wait);
+	pmfs_journal_t *journal = pmfs_get_journal(sb);
+	unsigned int nr = le16_to_cpu(journal->num_lanes);
+
+	return le16_to_cpu(journal->log_format) != PMFS_LOG_FORMAT_PACKED ||
+		!nr || (PMFS_SB(sb)->redo_log && nr > 1);
 }
 
-int pmfs_journal_uninit(struct super_block *sb)
+/* Reformats the empty journal of an old image, splitting a single log into
+ * lanes (or, for a redo log, merging lanes into one) and switching to
+ * packed records. The new lanes and cleaner are allocated first, so that
+ * a failure leaves the journal as it was. The caller keeps transactions
+ * out. */
+static int pmfs_upgrade_journal(struct super_block *sb)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	pmfs_journal_t *journal = pmfs_get_journal(sb);
+	uint32_t size = le32_to_cpu(journal->size);
+	struct pmfs_journal_lane *lanes;
+	struct workqueue_struct *wq;
+	unsigned int i, nr;
+
+	if (size < PMFS_LANE_HDR_SIZE + PMFS_MIN_LANE_SIZE) {
+		pmfs_err(sb, "journal of %x bytes is too small\n", size);
+		return -EINVAL;
+	}
+	nr = pmfs_journal_nr_lanes(size, journal->redo_logging);
+	lanes = kcalloc(nr, sizeof(*lanes), GFP_KERNEL);
+	if (!lanes)
+		return -ENOMEM;
+	wq = pmfs_journal_cleaner_alloc(sb);
+	if (!wq) {
+		kfree(lanes);
+		return -ENOMEM;
+	}
+
+	pmfs_journal_cleaner_stop(sbi);
+	for (i = 0; i < sbi->num_lanes; i++) {
+		pmfs_clean_journal(sb, &sbi->lanes[i], true);
+		if (sbi->lanes[i].journal->head !=
+				sbi->lanes[i].journal->tail) {
+			pmfs_err(sb, "journal lane %u is not empty, cannot "
+				"reformat it\n", i);
+			pmfs_journal_cleaner_start(sbi, wq);
+			kfree(lanes);
+			return -EBUSY;
+		}
+	}
+	nr = pmfs_format_lanes(sb, journal);
+	pmfs_journal_init_lanes(sb, lanes, journal,
+		pmfs_get_block(sb, le64_to_cpu(journal->base)), nr);
+	kfree(sbi->lanes);
+	sbi->lanes = lanes;
+	sbi->num_lanes = nr;
+	pmfs_journal_cleaner_start(sbi, wq);
+	pmfs_info("PMFS: journal reformatted with %u lanes\n", nr);
+	return 0;
+}
+
+/* Brings an empty journal in an older layout up to date. Called when the
+ * file system is mounted read-write, and on a remount read-write of one
+ * that was mounted read-only, with transactions held off. */
+int pmfs_journal_upgrade(struct super_block *sb)
+{
+	if (!pmfs_journal_outdated(sb))
+		return 0;
+	return pmfs_upgrade_journal(sb);
+}
+
+/* Moves the journal to a freshly allocated region of size bytes, which
+ * grows or shrinks it without reformatting. New transactions are held off
+ * and the running ones drained, after which the cleaner leaves every lane
+ * empty. Everything that can fail, the new cleaner and lanes included, is
+ * set up before the header changes, so a failed resize keeps the old
+ * journal. The header is then switched in three steps, each persistent
+ * before the next and each leaving an empty log for recovery to find:
+ * num_lanes drops to 0 so that the header describes a single empty log,
+ * base and size move together, and the lanes already laid out in the new
+ * region are published. */
+int pmfs_journal_resize(struct super_block *sb, uint32_t size)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	pmfs_journal_t *journal = pmfs_get_journal(sb);
+	uint64_t old_base = le64_to_cpu(journal->base);
+	uint32_t old_size = le32_to_cpu(journal->size);
+	uint32_t min_size = PMFS_MIN_LANE_SIZE;
+	struct pmfs_journal_lane *lanes, *old_lanes;
+	struct workqueue_struct *wq;
+	unsigned long blocknr;
+	uint64_t base;
+	unsigned int i, nr;
+	u64 *ptr = (u64 *)&journal->size;
+	u64 old_word, new_word;
+	bool swapped;
+	int allocated, ret;
+
+	if (size == old_size)
+		return 0;
+	if (sbi->redo_log)
+		min_size *= 2;
+	if (size < PMFS_LANE_HDR_SIZE + min_size) {
+		pmfs_err(sb, "journal of %x bytes is too small\n", size);
+		return -EINVAL;
+	}
+	allocated = pmfs_new_blocks(sb, &blocknr, size >> PAGE_SHIFT,
+		PMFS_BLOCK_TYPE_4K, 0, 0);
+	if (allocated < 0)
+		return allocated;
+	if (allocated < (size >> PAGE_SHIFT)) {
+		pmfs_free_blocks(sb, blocknr, allocated, PMFS_BLOCK_TYPE_4K);
+		return -ENOSPC;
+	}
+	base = (uint64_t)blocknr << PAGE_SHIFT;
+	wq = pmfs_journal_cleaner_alloc(sb);
+	if (!wq) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	percpu_down_write(&sbi->journal_sem);
+	pmfs_journal_cleaner_stop(sbi);
+	for (i = 0; i < sbi->num_lanes; i++) {
+		pmfs_clean_journal(sb, &sbi->lanes[i], true);
+		if (sbi->lanes[i].journal->head !=
+				sbi->lanes[i].journal->tail) {
+			pmfs_err(sb, "journal lane %u is not empty, cannot "
+				"resize\n", i);
+			ret = -EBUSY;
+			goto out_restart;
+		}
+	}
+	nr = pmfs_format_area(sb, base, size, journal->redo_logging);
+	lanes = pmfs_journal_alloc_lanes(sb, journal,
+		pmfs_get_block(sb, base), nr);
+	if (!lanes) {
+		ret = -ENOMEM;
+		goto out_restart;
+	}
 
-	if (sbi->log_cleaner_thread)
-		kthread_stop(sbi->log_cleaner_thread);
+	pmfs_memunlock_log(sb, journal, sizeof(*journal));
+	journal->num_lanes = 0;
+	pmfs_memlock_range(sb, journal, sizeof(*journal));
+	pmfs_flush_buffer(&journal->num_lanes, sizeof(journal->num_lanes),
+		false);
+	PERSISTENT_MARK();
+	PERSISTENT_BARRIER();
+
+	/* size shares its 8 bytes with the unused head of the header. The
+	 * cmpxchg only keeps base and size together in the cache; they are
+	 * made persistent by the flush and fence that follow */
+	old_word = *ptr;
+	new_word = cpu_to_le64((le64_to_cpu(old_word) & ~0xFFFFFFFFULL) |
+		size);
+	pmfs_memunlock_log(sb, journal, sizeof(*journal));
+	swapped = cmpxchg_double_local((u64 *)&journal->base, ptr,
+		*(u64 *)&journal->base, old_word, cpu_to_le64(base), new_word);
+	pmfs_memlock_range(sb, journal, sizeof(*journal));
+	WARN_ON(!swapped);
+	pmfs_flush_buffer(journal, 16, false);
+	PERSISTENT_MARK();
+	PERSISTENT_BARRIER();
+
+	pmfs_memunlock_log(sb, journal, sizeof(*journal));
+	journal->num_lanes = cpu_to_le16(nr);
+	pmfs_memlock_range(sb, journal, sizeof(*journal));
+	pmfs_flush_buffer(&journal->num_lanes, sizeof(journal->num_lanes),
+		false);
+	PERSISTENT_MARK();
+	PERSISTENT_BARRIER();
+
+	old_lanes = sbi->lanes;
+	sbi->lanes = lanes;
+	sbi->num_lanes = nr;
+	sbi->jsize = size;
+	kfree(old_lanes);
+	pmfs_journal_cleaner_start(sbi, wq);
+	percpu_up_write(&sbi->journal_sem);
+
+	pmfs_free_blocks(sb, old_base >> PAGE_SHIFT, old_size >> PAGE_SHIFT,
+		PMFS_BLOCK_TYPE_4K);
+	pmfs_info("PMFS: journal resized from %x to %x bytes, %u lanes\n",
+		old_size, size, nr);
+	return 0;
+
+out_restart:
+	/* the header still describes the old journal */
+	pmfs_journal_cleaner_start(sbi, wq);
+	percpu_up_write(&sbi->journal_sem);
+out_free:
+	pmfs_free_blocks(sb, blocknr, size >> PAGE_SHIFT, PMFS_BLOCK_TYPE_4K);
+	return ret;
+}
+
+int pmfs_journal_uninit(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	unsigned int i;
+
+	pmfs_journal_cleaner_stop(sbi);
+	/* a failed mount leaves the log as it found it */
+	if (!test_opt(sb, MOUNTING))
+		for (i = 0; i < sbi->num_lanes; i++)
+			pmfs_clean_journal(sb, &sbi->lanes[i], true);
+	kfree(sbi->lanes);
+	sbi->lanes = NULL;
+	sbi->num_lanes = 0;
 	return 0;
 }
 
@@ -478,19 +1007,138 @@ inline pmfs_transaction_t *pmfs_current_transaction(void)
 	return (pmfs_transaction_t *)current->journal_info;
 }
 
-static int pmfs_free_logentries(int max_log_entries)
+/* Transactions are spread over the lanes by CPU. A task that migrates
+ * after picking a lane just keeps using it, which is harmless since
+ * reservations are atomic. */
+static inline struct pmfs_journal_lane *pmfs_get_lane(struct pmfs_sb_info *sbi)
+{
+	unsigned int cpu = get_cpu();
+
+	put_cpu();
+	return &sbi->lanes[cpu % sbi->num_lanes];
+}
+
+/* Finds a lane with req_size bytes of free log. The log is reclaimed
+ * synchronously, starting with the lane the caller picked. If every lane
+ * is held up by running transactions, the caller waits for them to
+ * commit, which throttles writers to the rate the log drains at. A task
+ * that is inside a transaction itself does not wait: its own uncommitted
+ * entries may be what holds the log. */
+static struct pmfs_journal_lane *pmfs_free_logentries(struct super_block *sb,
+		struct pmfs_journal_lane *lane, uint32_t req_size,
+		unsigned long deadline)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	unsigned int i, first = lane - sbi->lanes;
+	DEFINE_WAIT(wait);
+
+	if (req_size > lane->jsize - LOGENTRY_SIZE)
+		return ERR_PTR(-EAGAIN);
+	for ( ; ; ) {
+		for (i = 0; i < sbi->num_lanes; i++) {
+			lane = &sbi->lanes[(first + i) % sbi->num_lanes];
+			if (pmfs_lane_avail_size(lane) >= req_size)
+				return lane;
+			atomic_long_inc(&lane->nr_sync_cleans);
+			pmfs_clean_journal(sb, lane, false);
+			if (pmfs_lane_avail_size(lane) >= req_size)
+				return lane;
+		}
+		if (current->journal_info || time_after(jiffies, deadline))
+			return ERR_PTR(-EAGAIN);
+		atomic_long_inc(&sbi->lanes[first].nr_waits);
+
+		prepare_to_wait(&sbi->journal_space_wait, &wait,
+			TASK_UNINTERRUPTIBLE);
+		schedule_timeout(PMFS_JOURNAL_WAIT);
+		finish_wait(&sbi->journal_space_wait, &wait);
+	}
+}
+
+/* Reserves req_size bytes of a lane without taking a lock. tail and gen_id
+ * share an 8-byte word, which a cmpxchg either moves forward or, when the
+ * reservation would wrap, resets to the start of the lane with the next
+ * gen_id so that no transaction wraps. Returns -ENOSPC if the lane is too
+ * full, else the offset of the space, its gen_id and the space left.
+ * On success the reservation stays counted in lane->nr_reserving until the
+ * caller has made its start record visible with pmfs_start_logrec(). */
+static int pmfs_reserve_log(struct super_block *sb,
+		struct pmfs_journal_lane *lane, uint32_t req_size,
+		uint32_t *off, uint16_t *gen_id, uint32_t *avail)
+{
+	pmfs_journal_t *journal = lane->journal;
+	u64 *ptr = (u64 *)&journal->tail;
+	u64 old, new, cur;
+	uint32_t head, tail, avail_size;
+	uint16_t gen;
+
+	/* counted before the cmpxchg makes the space visible to the
+	 * cleaner; the cmpxchg orders the two */
+	atomic_inc(&lane->nr_reserving);
+	old = le64_to_cpu((__force __le64)ACCESS_ONCE(*ptr));
+	for ( ; ; ) {
+		head = le32_to_cpu(ACCESS_ONCE(journal->head));
+		tail = old & 0xFFFFFFFF;
+		gen = (old >> 32) & 0xFFFF;
+		avail_size = (tail >= head) ?
+			(lane->jsize - (tail - head)) : (head - tail);
+		avail_size = avail_size - LOGENTRY_SIZE;
+		if (avail_size < req_size) {
+			atomic_dec(&lane->nr_reserving);
+			return -ENOSPC;
+		}
+
+		if (tail + req_size >= lane->jsize)
+			new = (old & ~0xFFFFFFFFFFFFULL) |
+				(u64)next_gen_id(gen) << 32;
+		else
+			new = old + req_size;
+		pmfs_memunlock_log(sb, journal, sizeof(*journal));
+		cur = le64_to_cpu((__force __le64)cmpxchg64(ptr,
+			(__force u64)cpu_to_le64(old),
+			(__force u64)cpu_to_le64(new)));
+		pmfs_memlock_range(sb, journal, sizeof(*journal));
+		if (cur != old) {
+			/* lost a race with another reservation */
+			old = cur;
+			continue;
+		}
+		if ((new & 0xFFFFFFFF) == 0) {
+			pmfs_dbg_trans("journal wrapped. gid %d\n",
+				next_gen_id(gen));
+			old = new;
+			continue;
+		}
+		break;
+	}
+	pmfs_flush_buffer(&journal->tail, sizeof(u64), false);
+	*off = tail;
+	*gen_id = gen;
+	*avail = avail_size - req_size;
+	return 0;
+}
+
+/* Writes the empty record that starts a transaction and fences it, so
+ * that the cleaner can tell the space is in use, then drops the count
+ * taken by pmfs_reserve_log(). */
+static void pmfs_start_logrec(struct super_block *sb,
+		struct pmfs_journal_lane *lane, pmfs_transaction_t *trans)
 {
-	pmfs_dbg("pmfs_free_logentries: Not Implemented\n");
-	return -ENOMEM;
+	pmfs_add_logentry(sb, trans, NULL, 0, LE_DATA);
+	__pmfs_log_fence(sb, trans);
+	smp_mb__before_atomic_dec();
+	atomic_dec(&lane->nr_reserving);
 }
 
 pmfs_transaction_t *pmfs_new_transaction(struct super_block *sb,
 		int max_log_entries)
 {
-	pmfs_journal_t *journal = pmfs_get_journal(sb);
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_journal_lane *lane;
+	pmfs_journal_t *journal;
 	pmfs_transaction_t *trans;
-	uint32_t head, tail, req_size, avail_size;
+	uint32_t tail, req_size, avail_size;
+	unsigned long deadline = jiffies + PMFS_JOURNAL_WAIT_MAX;
 	uint64_t base;
 #if 0
 	trans = pmfs_current_transaction();
@@ -500,206 +1148,451 @@ pmfs_transaction_t *pmfs_new_transaction(struct super_block *sb,
 		return trans;
 	}
 #endif
-	/* If it is an undo log, need one more log-entry for commit record */
-	if (!sbi->redo_log)
-		max_log_entries++;
+	/* one more log-entry for commit record. A redo log also needs room
+	 * for the new contents of every range. The start record takes one
+	 * more. */
+	if (sbi->redo_log)
+		max_log_entries = 2 * max_log_entries + 2;
+	else
+		max_log_entries += 2;
 
 	trans = pmfs_alloc_transaction();
 	if (!trans)
 		return ERR_PTR(-ENOMEM);
 	memset(trans, 0, sizeof(*trans));
 
-	trans->num_used = 0;
-	trans->num_entries = max_log_entries;
-	trans->t_journal = journal;
-	req_size = max_log_entries << LESIZE_SHIFT;
+	/* only the outermost transaction holds off a journal resize, as a
+	 * nested read would deadlock against a waiting resize */
+	if (!current->journal_info)
+		percpu_down_read(&sbi->journal_sem);
+	lane = pmfs_get_lane(sbi);
 
-	mutex_lock(&sbi->journal_mutex);
+	req_size = max_log_entries << LESIZE_SHIFT;
+	trans->size = req_size;
+	trans->status = TRANS_RUNNING;
 
-	tail = le32_to_cpu(journal->tail);
-	head = le32_to_cpu(journal->head);
-	trans->transaction_id = sbi->next_transaction_id++;
-again:
-	trans->gen_id = le16_to_cpu(journal->gen_id);
-	avail_size = (tail >= head) ?
-		(sbi->jsize - (tail - head)) : (head - tail);
-	avail_size = avail_size - LOGENTRY_SIZE;
-
-	if (avail_size < req_size) {
-		uint32_t freed_size;
-		/* run the log cleaner function to free some log entries */
-		freed_size = pmfs_free_logentries(max_log_entries);
-		if ((avail_size + freed_size) < req_size)
+retry:
+	journal = lane->journal;
+	trans->t_journal = journal;
+	if (pmfs_reserve_log(sb, lane, req_size, &tail, &trans->gen_id,
+			&avail_size)) {
+		/* reclaim log entries or wait for a lane to drain */
+		lane = pmfs_free_logentries(sb, lane, req_size, deadline);
+		if (IS_ERR(lane))
 			goto journal_full;
+		goto retry;
 	}
+	trans->transaction_id = atomic_inc_return(&lane->next_transaction_id);
 	base = le64_to_cpu(journal->base) + tail;
-	tail = tail + req_size;
-	/* journal wraparound because of this transaction allocation.
-	 * start the transaction from the beginning of the journal so
-	 * that we don't have any wraparound within a transaction */
-	pmfs_memunlock_range(sb, journal, sizeof(*journal));
-	if (tail >= sbi->jsize) {
-		u64 *ptr;
-		tail = 0;
-		ptr = (u64 *)&journal->tail;
-		/* writing 8-bytes atomically setting tail to 0 */
-		set_64bit(ptr, (__force u64)cpu_to_le64((u64)next_gen_id(
-					le16_to_cpu(journal->gen_id)) << 32));
-		pmfs_memlock_range(sb, journal, sizeof(*journal));
-		pmfs_dbg_trans("journal wrapped. tail %x gid %d cur tid %d\n",
-			le32_to_cpu(journal->tail),le16_to_cpu(journal->gen_id),
-				sbi->next_transaction_id - 1);
-		goto again;
-	} else {
-		journal->tail = cpu_to_le32(tail);
-		pmfs_memlock_range(sb, journal, sizeof(*journal));
-	}
-	pmfs_flush_buffer(&journal->tail, sizeof(u64), false);
-	mutex_unlock(&sbi->journal_mutex);
 
-	avail_size = avail_size - req_size;
-	/* wake up the log cleaner if required */
-	if ((sbi->jsize - avail_size) > (sbi->jsize >> 3))
-		wakeup_log_cleaner(sbi);
+	/* kick the log cleaner if required */
+	if ((lane->jsize - avail_size) > (lane->jsize >> 3))
+		pmfs_kick_cleaner(sbi, lane);
 
 	pmfs_dbg_trans("new transaction tid %d nle %d avl sz %x sa %llx\n",
 		trans->transaction_id, max_log_entries, avail_size, base);
 	trans->start_addr = pmfs_get_block(sb, base);
+	pmfs_start_logrec(sb, lane, trans);
 
+	/* the records of an enclosing transaction are fenced before this
+	 * one takes over current->journal_info */
+	pmfs_log_fence(sb);
 	trans->parent = (pmfs_transaction_t *)current->journal_info;
 	current->journal_info = trans;
 	return trans;
 journal_full:
-	mutex_unlock(&sbi->journal_mutex);
 	pmfs_err(sb, "Journal full. base %llx sz %x head:tail %x:%x ncl %x\n",
 		le64_to_cpu(journal->base), le32_to_cpu(journal->size),
 		le32_to_cpu(journal->head), le32_to_cpu(journal->tail),
 		max_log_entries);
+	if (!current->journal_info)
+		percpu_up_read(&sbi->journal_sem);
 	pmfs_free_transaction(trans);
 	return ERR_PTR(-EAGAIN);
 }
 
+/* A record is built in the transaction's staging buffer and streamed into
+ * the log with non-temporal stores, which neither read the log line into
+ * the cache first nor leave it there to be flushed. The header goes out
+ * last, once the checksum of everything after it is known; the fence that
+ * orders the record comes from pmfs_log_fence() or the commit. */
+struct pmfs_log_stream {
+	pmfs_transaction_t	*trans;
+	pmfs_logrec_t		*rec;
+	pmfs_logrec_t		hdr;
+	u64			*dst;
+	u32			crc;
+	unsigned int		fill;
+};
+
+static void pmfs_stream_begin(struct pmfs_log_stream *ls,
+		pmfs_transaction_t *trans, pmfs_logrec_t *rec, uint32_t size,
+		u8 type, u8 nr)
+{
+	ls->trans = trans;
+	ls->rec = rec;
+	ls->hdr.size = cpu_to_le16(size);
+	ls->hdr.type = type;
+	if ((void *)rec == trans->start_addr)
+		ls->hdr.type |= LE_START;
+	ls->hdr.nr_ranges = nr;
+	ls->dst = (u64 *)(rec + 1);
+	ls->crc = crc32c(trans->gen_id, &ls->hdr.size,
+		sizeof(ls->hdr) - sizeof(ls->hdr.csum));
+	ls->fill = 0;
+}
+
+static void pmfs_stream_put(struct pmfs_log_stream *ls, const void *src,
+		size_t len)
+{
+	char *stage = (char *)ls->trans->log_stage;
+	size_t n;
+
+	ls->crc = crc32c(ls->crc, src, len);
+	while (len) {
+		n = min_t(size_t, len, PMFS_LOG_STAGE_SIZE - ls->fill);
+		memcpy(stage + ls->fill, src, n);
+		ls->fill += n;
+		src += n;
+		len -= n;
+		if (ls->fill == PMFS_LOG_STAGE_SIZE) {
+			memcpy_nt(ls->dst, stage, PMFS_LOG_STAGE_SIZE);
+			ls->dst += PMFS_LOG_STAGE_SIZE / sizeof(u64);
+			ls->fill = 0;
+		}
+	}
+}
+
+static void pmfs_stream_end(struct pmfs_log_stream *ls)
+{
+	static const u64 zero;
+	unsigned int pad = -ls->fill & (PMFS_LOGREC_ALIGN - 1);
+
+	if (pad)
+		pmfs_stream_put(ls, &zero, pad);
+	if (ls->fill)
+		memcpy_nt(ls->dst, ls->trans->log_stage, ls->fill);
+	/* same as pmfs_logrec_csum() */
+	ls->hdr.csum = cpu_to_le32(ls->crc ? ls->crc : 1);
+	memcpy_nt(ls->rec, &ls->hdr, sizeof(ls->hdr));
+}
+
+/* writes a record without ranges: commit, abort, or commit with the
+ * commit sequence of a redo log */
+static void pmfs_write_ctl_logrec(struct super_block *sb,
+		pmfs_transaction_t *trans, pmfs_logrec_t *rec, u8 type,
+		const __le64 *seq)
+{
+	struct pmfs_log_stream ls;
+	uint32_t size = sizeof(*rec) + (seq ? sizeof(*seq) : 0);
+
+	pmfs_memunlock_log(sb, rec, size);
+	pmfs_stream_begin(&ls, trans, rec, size, type, 0);
+	if (seq)
+		pmfs_stream_put(&ls, seq, sizeof(*seq));
+	pmfs_stream_end(&ls);
+	pmfs_memlock_range(sb, rec, size);
+}
+
 static inline void pmfs_commit_logentry(struct super_block *sb,
-		pmfs_transaction_t *trans, pmfs_logentry_t *le)
+		pmfs_transaction_t *trans, pmfs_logrec_t *rec)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	__le64 seq;
+
 	if (sbi->redo_log) {
 		/* Redo Log */
-		PERSISTENT_MARK();
-		PERSISTENT_BARRIER();
-		/* Atomically write the commit type */
-		le->type |= LE_COMMIT;
-		barrier();
-		/* Atomically make the log entry valid */
-		le->gen_id = cpu_to_le16(trans->gen_id);
-		pmfs_flush_buffer(le, LOGENTRY_SIZE, false);
-		PERSISTENT_MARK();
-		PERSISTENT_BARRIER();
-		/* Update the FS in place */
-		pmfs_flush_transaction(sb, trans);
+		/* The new contents are already in the log. The in-place
+		 * updates are left for the log cleaner to flush; recovery
+		 * replays committed transactions in commit sequence order */
+		seq = cpu_to_le64(atomic64_inc_return(&sbi->commit_seq));
+		/* updates that were not logged still have to be durable */
+		pmfs_flush_dirty(sb, trans);
 	} else {
 		/* Undo Log */
 		/* Update the FS in place: currently already done. so
 		 * only need to clflush */
 		pmfs_flush_transaction(sb, trans);
-		PERSISTENT_MARK();
-		PERSISTENT_BARRIER();
-		/* Atomically write the commit type */
-		le->type |= LE_COMMIT;
-		barrier();
-		/* Atomically make the log entry valid */
-		le->gen_id = cpu_to_le16(trans->gen_id);
-		pmfs_flush_buffer(le, LOGENTRY_SIZE, true);
 	}
+	PERSISTENT_MARK();
+	PERSISTENT_BARRIER();
+	/* a torn commit record fails its checksum */
+	pmfs_write_ctl_logrec(sb, trans, rec, LE_COMMIT,
+		sbi->redo_log ? &seq : NULL);
+	PERSISTENT_BARRIER();
+	trans->fenced = trans->used;
 }
 
-int pmfs_add_logentry(struct super_block *sb,
-		pmfs_transaction_t *trans, void *addr, uint16_t size, u8 type)
+/* group commit only applies to the undo log, where every commit otherwise
+ * ends in two fences of its own */
+static inline bool pmfs_group_commit_enabled(struct super_block *sb)
+{
+	return test_opt(sb, GROUP_COMMIT) && !PMFS_SB(sb)->redo_log;
+}
+
+/* Logs the current contents of several ranges in one record, which costs
+ * one header and one fence for all of them. Ranges may not overlap. A
+ * commit or abort record takes no ranges. */
+int pmfs_add_logentries(struct super_block *sb, pmfs_transaction_t *trans,
+		const struct pmfs_log_range *ranges, int nr, u8 type)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
-	pmfs_logentry_t *le;
-	int num_les = 0, i;
-	uint64_t le_start = size ? pmfs_get_addr_off(sbi, addr) : 0;
-	uint8_t le_size;
+	struct pmfs_log_stream ls;
+	pmfs_logrec_t *rec;
+	__le64 off_len;
+	uint32_t size;
+	int i;
 
 	if (trans == NULL)
 		return -EINVAL;
-	le = trans->start_addr + trans->num_used;
-
-	if (size == 0) {
-		/* At least one log entry required for commit/abort log entry */
-		if ((type & LE_COMMIT) || (type & LE_ABORT))
-			num_les = 1;
-	} else
-		num_les = (size + sizeof(le->data) - 1)/sizeof(le->data);
-
-	pmfs_dbg_trans("add le id %d size %x, num_les %d tail %x le %p\n",
-		trans->transaction_id, size, trans->num_entries,
-		trans->num_used, le);
-
-	if ((trans->num_used + num_les) > trans->num_entries) {
-		pmfs_err(sb, "Log Entry full. tid %x ne %x tail %x size %x\n",
-			trans->transaction_id, trans->num_entries,
-			trans->num_used, size);
+	size = sizeof(*rec) + nr * sizeof(pmfs_logrange_t);
+	for (i = 0; i < nr; i++)
+		size += ranges[i].size;
+	if ((type & LE_COMMIT) && sbi->redo_log)
+		size += sizeof(__le64);
+	size = ALIGN(size, PMFS_LOGREC_ALIGN);
+	rec = trans->start_addr + trans->used;
+
+	pmfs_dbg_trans("add le id %d size %x nr %d used %x rec %p\n",
+		trans->transaction_id, size, nr, trans->used, rec);
+
+	if (nr > PMFS_MAX_LOGREC_RANGES || size > PMFS_MAX_LOGREC_SIZE ||
+			trans->used + size > trans->size) {
+		pmfs_err(sb, "Log Entry full. tid %x sz %x used %x size %x\n",
+			trans->transaction_id, trans->size, trans->used, size);
 		dump_transaction(sbi, trans);
 		dump_stack();
 		return -ENOMEM;
 	}
+	trans->used += size;
+
+	/* handle special log entry */
+	if (type & LE_COMMIT) {
+		/* with group commit, the group leader writes the commit
+		 * record */
+		if (!pmfs_group_commit_enabled(sb))
+			pmfs_commit_logentry(sb, trans, rec);
+		return 0;
+	}
 
-	pmfs_memunlock_range(sb, le, sizeof(*le) * num_les);
-	for (i = 0; i < num_les; i++) {
-		le->addr_offset = cpu_to_le64(le_start);
-		le->transaction_id = cpu_to_le32(trans->transaction_id);
-		le_size = (i == (num_les - 1)) ? size : sizeof(le->data);
-		le->size = le_size;
-		size -= le_size;
-		if (le_size)
-			memcpy(le->data, addr, le_size);
-		le->type = type;
-
-		if (i == 0 && trans->num_used == 0)
-			le->type |= LE_START;
-		trans->num_used++;
-
-		/* handle special log entry */
-		if (i == (num_les - 1) && (type & LE_COMMIT)) {
-			pmfs_commit_logentry(sb, trans, le);
-			pmfs_memlock_range(sb, le, sizeof(*le) * num_les);
-			return 0;
-		}
-		/* put a compile time barrier so that compiler doesn't reorder
-		 * the writes to the log entry */
-		barrier();
+	pmfs_memunlock_log(sb, rec, size);
+	pmfs_stream_begin(&ls, trans, rec, size, type, nr);
+	for (i = 0; i < nr; i++) {
+		off_len = cpu_to_le64(pmfs_get_addr_off(sbi, ranges[i].addr) |
+			(u64)ranges[i].size << PMFS_LOGRANGE_SHIFT);
+		pmfs_stream_put(&ls, &off_len, sizeof(off_len));
+	}
+	for (i = 0; i < nr; i++)
+		pmfs_stream_put(&ls, ranges[i].addr, ranges[i].size);
+	pmfs_stream_end(&ls);
+	pmfs_memlock_range(sb, rec, size);
+	/* the old contents must be persistent before the caller updates
+	 * them in place, in either mode. pmfs_log_fence() orders them when
+	 * the caller unlocks the memory to do so, so that a transaction
+	 * logging several ranges in a row pays for one fence */
+	return 0;
+}
 
-		/* Atomically make the log entry valid */
-		le->gen_id = cpu_to_le16(trans->gen_id);
-		pmfs_flush_buffer(le, LOGENTRY_SIZE, false);
+/* PMFS_DBGMASK_LOGORDER: checks that nothing covered by the records being
+ * fenced was changed before the fence */
+static void pmfs_check_log_order(struct super_block *sb,
+		pmfs_transaction_t *trans)
+{
+	pmfs_logrec_t *rec = trans->start_addr + trans->fenced;
+	pmfs_logrange_t *lr;
+	char *data;
+	u64 off_len;
+	uint16_t len;
+	int i;
 
-		addr += le_size;
-		le_start += le_size;
-		le++;
+	for ( ; (void *)rec < trans->start_addr + trans->used;
+	     rec = pmfs_next_logrec(rec)) {
+		if (!pmfs_is_undo_logrec(rec))
+			continue;
+		lr = (pmfs_logrange_t *)(rec + 1);
+		data = (char *)(lr + rec->nr_ranges);
+		for (i = 0; i < rec->nr_ranges; i++) {
+			off_len = le64_to_cpu(lr[i].off_len);
+			len = off_len >> PMFS_LOGRANGE_SHIFT;
+			if (memcmp(pmfs_get_block(sb, off_len &
+					PMFS_LOGRANGE_OFF_MASK), data, len)) {
+				pmfs_warn("tid %x: %llx changed before its log "
+					"record was fenced\n",
+					trans->transaction_id,
+					off_len & PMFS_LOGRANGE_OFF_MASK);
+				WARN_ON_ONCE(1);
+			}
+			data += len;
+		}
 	}
-	pmfs_memlock_range(sb, le, sizeof(*le) * num_les);
-	if (!sbi->redo_log) {
-		PERSISTENT_MARK();
-		PERSISTENT_BARRIER();
+}
+
+void __pmfs_log_fence(struct super_block *sb, pmfs_transaction_t *trans)
+{
+	if (unlikely(pmfs_dbgmask & PMFS_DBGMASK_LOGORDER))
+		pmfs_check_log_order(sb, trans);
+	PERSISTENT_MARK();
+	PERSISTENT_BARRIER();
+	trans->fenced = trans->used;
+}
+
+int pmfs_add_logentry(struct super_block *sb,
+		pmfs_transaction_t *trans, void *addr, uint16_t size, u8 type)
+{
+	struct pmfs_log_range range = { .addr = addr, .size = size };
+
+	return pmfs_add_logentries(sb, trans, &range, size ? 1 : 0, type);
+}
+
+/* Redo log: appends the current contents of every range the transaction
+ * logged, so that recovery can roll a committed transaction forward even
+ * though its in-place updates were never flushed. Each data record gets
+ * an LE_REDO twin of the same size. */
+static int pmfs_log_new_values(struct super_block *sb,
+		pmfs_transaction_t *trans)
+{
+	struct pmfs_log_stream ls;
+	pmfs_logrec_t *rec, *redo;
+	pmfs_logrange_t *lr;
+	uint32_t used = trans->used, size;
+	u64 off_len;
+	int i;
+
+	for (rec = trans->start_addr; (void *)rec < trans->start_addr + used;
+	     rec = pmfs_next_logrec(rec)) {
+		if (!rec->nr_ranges)
+			continue;
+		size = le16_to_cpu(rec->size);
+		if (trans->used + size > trans->size) {
+			pmfs_err(sb, "Log Entry full. tid %x sz %x used %x "
+				"redo\n", trans->transaction_id, trans->size,
+				trans->used);
+			return -ENOMEM;
+		}
+		redo = trans->start_addr + trans->used;
+		lr = (pmfs_logrange_t *)(rec + 1);
+		pmfs_memunlock_log(sb, redo, size);
+		pmfs_stream_begin(&ls, trans, redo, size, LE_REDO,
+			rec->nr_ranges);
+		pmfs_stream_put(&ls, lr, rec->nr_ranges * sizeof(*lr));
+		for (i = 0; i < rec->nr_ranges; i++) {
+			off_len = le64_to_cpu(lr[i].off_len);
+			pmfs_stream_put(&ls, pmfs_get_block(sb,
+				off_len & PMFS_LOGRANGE_OFF_MASK),
+				off_len >> PMFS_LOGRANGE_SHIFT);
+		}
+		pmfs_stream_end(&ls);
+		pmfs_memlock_range(sb, redo, size);
+		trans->used += size;
 	}
 	return 0;
 }
 
+/* Flushes a group of committing transactions: the in-place updates of all
+ * of them behind one fence, then writes all their commit records behind
+ * another.
+ * clflush, clflushopt and clwb write a line back from whichever cache
+ * holds it, so the leader can flush lines that other CPUs dirtied. */
+static void pmfs_commit_group(struct super_block *sb, struct list_head *group)
+{
+	pmfs_transaction_t *trans, *next;
+	pmfs_logrec_t *rec;
+
+	list_for_each_entry(trans, group, commit_list)
+		pmfs_flush_transaction(sb, trans);
+	PERSISTENT_MARK();
+	PERSISTENT_BARRIER();
+	list_for_each_entry(trans, group, commit_list) {
+		/* an undo log commit record is a bare header */
+		rec = trans->start_addr + trans->used - sizeof(*rec);
+		pmfs_write_ctl_logrec(sb, trans, rec, LE_COMMIT, NULL);
+	}
+	PERSISTENT_MARK();
+	PERSISTENT_BARRIER();
+
+	/* owners free their transaction as soon as they see it committed */
+	smp_mb();
+	list_for_each_entry_safe(trans, next, group, commit_list)
+		ACCESS_ONCE(trans->status) = TRANS_COMMITTED;
+}
+
+/* Queues a transaction whose commit record is written but not yet valid.
+ * The first committer to find no leader becomes one and commits everything
+ * queued; the others spin until their transaction is marked committed, so
+ * the commit is durable when pmfs_commit_transaction() returns either
+ * way. A leader commits a single group and then steps down. */
+static void pmfs_group_commit(struct super_block *sb,
+		pmfs_transaction_t *trans)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	LIST_HEAD(group);
+	unsigned int nr;
+	u64 start;
+
+	spin_lock(&sbi->commit_lock);
+	list_add_tail(&trans->commit_list, &sbi->commit_pending);
+	sbi->commit_nr_pending++;
+	for ( ; ; ) {
+		if (ACCESS_ONCE(trans->status) == TRANS_COMMITTED) {
+			spin_unlock(&sbi->commit_lock);
+			return;
+		}
+		if (!sbi->commit_leader)
+			break;
+		spin_unlock(&sbi->commit_lock);
+		while (ACCESS_ONCE(sbi->commit_leader) &&
+		       ACCESS_ONCE(trans->status) != TRANS_COMMITTED) {
+			cpu_relax();
+			cond_resched();
+		}
+		spin_lock(&sbi->commit_lock);
+	}
+	sbi->commit_leader = true;
+	spin_unlock(&sbi->commit_lock);
+
+	/* the last group was shared: give others a moment to join this one */
+	if (sbi->commit_last_group > 1) {
+		start = local_clock();
+		while (ACCESS_ONCE(sbi->commit_nr_pending) <
+				sbi->commit_last_group &&
+		       local_clock() - start < PMFS_COMMIT_WINDOW_NS)
+			cpu_relax();
+	}
+
+	spin_lock(&sbi->commit_lock);
+	list_splice_init(&sbi->commit_pending, &group);
+	nr = sbi->commit_nr_pending;
+	sbi->commit_nr_pending = 0;
+	spin_unlock(&sbi->commit_lock);
+
+	pmfs_commit_group(sb, &group);
+	sbi->commit_last_group = nr;
+
+	spin_lock(&sbi->commit_lock);
+	sbi->commit_leader = false;
+	spin_unlock(&sbi->commit_lock);
+}
+
 int pmfs_commit_transaction(struct super_block *sb,
 		pmfs_transaction_t *trans)
 {
 	if (trans == NULL)
 		return 0;
+	if (PMFS_SB(sb)->redo_log && pmfs_log_new_values(sb, trans))
+		goto out;
 	/* Add the commit log-entry */
-	pmfs_add_logentry(sb, trans, NULL, 0, LE_COMMIT);
+	if (pmfs_add_logentry(sb, trans, NULL, 0, LE_COMMIT) == 0 &&
+	    pmfs_group_commit_enabled(sb))
+		pmfs_group_commit(sb, trans);
 
 	pmfs_dbg_trans("completing transaction for id %d\n",
 		trans->transaction_id);
-
+out:
 	current->journal_info = trans->parent;
+	if (!trans->parent)
+		percpu_up_read(&PMFS_SB(sb)->journal_sem);
 	pmfs_free_transaction(trans);
+	pmfs_wake_journal_waiters(PMFS_SB(sb));
 	return 0;
 }
 
@@ -709,38 +1602,37 @@ int pmfs_abort_transaction(struct super_block *sb, pmfs_transaction_t *trans)
 
 	if (trans == NULL)
 		return 0;
-	pmfs_dbg_trans("abort trans for tid %x sa %p numle %d tail %x gen %d\n",
-		trans->transaction_id, trans->start_addr, trans->num_entries,
-		trans->num_used, trans->gen_id);
+	pmfs_dbg_trans("abort trans for tid %x sa %p size %x used %x gen %d\n",
+		trans->transaction_id, trans->start_addr, trans->size,
+		trans->used, trans->gen_id);
 	dump_transaction(sbi, trans);
 	/*dump_stack();*/
 
-	if (!sbi->redo_log) {
-		/* Undo Log */
-		pmfs_undo_transaction(sb, trans);
-		PERSISTENT_MARK();
-		PERSISTENT_BARRIER();
-	}
+	/* updates are made in place in either mode, so roll them back */
+	pmfs_undo_transaction(sb, trans);
+	PERSISTENT_MARK();
+	PERSISTENT_BARRIER();
 	/* add a abort log entry */
 	pmfs_add_logentry(sb, trans, NULL, 0, LE_ABORT);
+	PERSISTENT_BARRIER();
 	current->journal_info = trans->parent;
+	if (!trans->parent)
+		percpu_up_read(&sbi->journal_sem);
 	pmfs_free_transaction(trans);
+	pmfs_wake_journal_waiters(sbi);
 	return 0;
 }
 
 static void invalidate_remaining_journal(struct super_block *sb,
 	void *journal_vaddr, uint32_t jtail, uint32_t jsize)
 {
-	pmfs_logentry_t *le = (pmfs_logentry_t *)(journal_vaddr + jtail);
-	void *start = le;
+	void *start = journal_vaddr + jtail;
+	uint32_t len = jsize - jtail;
 
-	pmfs_memunlock_range(sb, start, jsize - jtail);
-	while (jtail < jsize) {
-		invalidate_gen_id(le);
-		le++;
-		jtail += LOGENTRY_SIZE;
-	}
-	pmfs_memlock_range(sb, start, jsize - jtail);
+	pmfs_memunlock_log(sb, start, len);
+	for ( ; jtail < jsize; jtail += LOGENTRY_SIZE)
+		invalidate_logrec(journal_vaddr + jtail);
+	pmfs_memlock_range(sb, start, len);
 }
 
 /* we need to increase the gen_id to invalidate all the journal log
@@ -750,20 +1642,21 @@ static void invalidate_remaining_journal(struct super_block *sb,
  * should gen_id and head be updated atomically? not necessarily? we
  * can update gen_id before journal head because gen_id and head are in
  * the same cacheline */
-static void pmfs_forward_journal(struct super_block *sb, struct pmfs_sb_info
-		*sbi, pmfs_journal_t *journal)
+static void pmfs_forward_journal(struct super_block *sb,
+		struct pmfs_journal_lane *lane)
 {
+	pmfs_journal_t *journal = lane->journal;
 	uint16_t gen_id = le16_to_cpu(journal->gen_id);
 	/* handle gen_id wrap around */
 	if (gen_id == MAX_GEN_ID) {
-		invalidate_remaining_journal(sb, sbi->journal_base_addr,
-			le32_to_cpu(journal->tail), sbi->jsize);
+		invalidate_remaining_journal(sb, lane->base_addr,
+			le32_to_cpu(journal->tail), lane->jsize);
 	}
 	PERSISTENT_MARK();
 	gen_id = next_gen_id(gen_id);
 	/* make all changes persistent before advancing gen_id and head */
 	PERSISTENT_BARRIER();
-	pmfs_memunlock_range(sb, journal, sizeof(*journal));
+	pmfs_memunlock_log(sb, journal, sizeof(*journal));
 	journal->gen_id = cpu_to_le16(gen_id);
 	barrier();
 	journal->head = journal->tail;
@@ -771,69 +1664,112 @@ static void pmfs_forward_journal(struct super_block *sb, struct pmfs_sb_info
 	pmfs_flush_buffer(journal, sizeof(*journal), false);
 }
 
-static int pmfs_recover_undo_journal(struct super_block *sb)
+/* a transaction found in the log during recovery */
+struct pmfs_log_trans {
+	u64			seq;	/* commit sequence of a redo log */
+	pmfs_transaction_t	trans;
+};
+
+/* Records the transactions of every non-empty lane in lts, in log order,
+ * or only counts them if lts is NULL. */
+static unsigned long pmfs_scan_journal(struct super_block *sb,
+		struct pmfs_log_trans *lts)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
-	pmfs_journal_t *journal = pmfs_get_journal(sb);
-	uint32_t tail = le32_to_cpu(journal->tail);
-	uint32_t head = le32_to_cpu(journal->head);
-	uint16_t gen_id = le16_to_cpu(journal->gen_id);
-	pmfs_logentry_t *le;
-
-	while (head != tail) {
-		/* handle journal wraparound */
-		if (tail == 0)
+	struct pmfs_journal_lane *lane;
+	struct pmfs_log_trans lt;
+	unsigned long n = 0;
+	uint32_t head, tail;
+	uint16_t gen_id;
+	pmfs_logrec_t *rec;
+	unsigned int i;
+
+	for (i = 0; i < sbi->num_lanes; i++) {
+		lane = &sbi->lanes[i];
+		tail = le32_to_cpu(lane->journal->tail);
+		head = le32_to_cpu(lane->journal->head);
+		gen_id = le16_to_cpu(lane->journal->gen_id);
+		/* journal wrapped around. so head points to previous
+		 * generation id */
+		if (tail < head)
 			gen_id = prev_gen_id(gen_id);
-		tail = prev_log_entry(sbi->jsize, tail);
 
-		le = (pmfs_logentry_t *)(sbi->journal_base_addr + tail);
-		if (gen_id == le16_to_cpu(le->gen_id)) {
-			tail = pmfs_recover_transaction(sb, head, tail, le);
-		} else {
-			if (gen_id == MAX_GEN_ID) {
-				pmfs_memunlock_range(sb, le, sizeof(*le));
-				invalidate_gen_id(le);
-				pmfs_memlock_range(sb, le, sizeof(*le));
+		while (head != tail) {
+			rec = pmfs_get_logrec(lane, head,
+				pmfs_log_end(lane, head, tail), gen_id);
+			if (rec && (rec->type & LE_START)) {
+				if (lts)
+					lts[n].seq = 0;
+				head = pmfs_scan_transaction(lane, head, tail,
+					gen_id, lts ? &lts[n].trans : &lt.trans,
+					lts ? &lts[n].seq : NULL);
+				n++;
+			} else {
+				rec = lane->base_addr + head;
+				if (lts && gen_id == MAX_GEN_ID) {
+					pmfs_memunlock_log(sb, rec,
+						sizeof(*rec));
+					invalidate_logrec(rec);
+					pmfs_memlock_range(sb, rec,
+						sizeof(*rec));
+				}
+				head = next_log_entry(lane->jsize, head);
 			}
+			/* handle journal wraparound */
+			if (head == 0)
+				gen_id = next_gen_id(gen_id);
 		}
 	}
-	pmfs_forward_journal(sb, sbi, journal);
-	PERSISTENT_MARK();
-	PERSISTENT_BARRIER();
-	return 0;
+	return n;
 }
 
-static int pmfs_recover_redo_journal(struct super_block *sb)
+static int pmfs_cmp_commit_seq(const void *a, const void *b)
+{
+	u64 x = ((const struct pmfs_log_trans *)a)->seq;
+	u64 y = ((const struct pmfs_log_trans *)b)->seq;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Rolls back every transaction that never committed. In a redo log every
+ * transaction holds both the old and the new contents of what it changed,
+ * and the in-place updates of committed transactions may not have been
+ * flushed, so committed ones are then rolled forward across all lanes in
+ * the order they committed and the last update to a location wins. */
+static int pmfs_recover_lanes(struct super_block *sb)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
-	pmfs_journal_t *journal = pmfs_get_journal(sb);
-	uint32_t tail = le32_to_cpu(journal->tail);
-	uint32_t head = le32_to_cpu(journal->head);
-	uint16_t gen_id = le16_to_cpu(journal->gen_id);
-	pmfs_logentry_t *le;
+	struct pmfs_log_trans *lts;
+	unsigned long i, n;
 
-	/* journal wrapped around. so head points to previous generation id */
-	if (tail < head)
-		gen_id = prev_gen_id(gen_id);
+	n = pmfs_scan_journal(sb, NULL);
+	lts = vmalloc(max(n, 1UL) * sizeof(*lts));
+	if (!lts)
+		return -ENOMEM;
+	n = pmfs_scan_journal(sb, lts);
 
-	while (head != tail) {
-		le = (pmfs_logentry_t *)(sbi->journal_base_addr + head);
-		if (gen_id == le16_to_cpu(le->gen_id)) {
-			head = pmfs_process_transaction(sb, head, tail,
-				le, true);
-		} else {
-			if (gen_id == MAX_GEN_ID) {
-				pmfs_memunlock_range(sb, le, sizeof(*le));
-				invalidate_gen_id(le);
-				pmfs_memlock_range(sb, le, sizeof(*le));
-			}
-			head = next_log_entry(sbi->jsize, head);
-		}
-		/* handle journal wraparound */
-		if (head == 0)
-			gen_id = next_gen_id(gen_id);
+	for (i = n; i-- > 0; )
+		if (lts[i].trans.status == TRANS_RUNNING)
+			pmfs_undo_transaction(sb, &lts[i].trans);
+
+	if (sbi->redo_log) {
+		sort(lts, n, sizeof(*lts), pmfs_cmp_commit_seq, NULL);
+		for (i = 0; i < n; i++)
+			if (lts[i].trans.status == TRANS_COMMITTED)
+				pmfs_redo_transaction(sb, &lts[i].trans, true);
 	}
-	pmfs_forward_journal(sb, sbi, journal);
+
+	/* make all changes persistent before invalidating the log */
+	PERSISTENT_MARK();
+	PERSISTENT_BARRIER();
+	for (i = 0; i < n; i++)
+		if (lts[i].trans.gen_id == MAX_GEN_ID)
+			pmfs_invalidate_logentries(sb, &lts[i].trans);
+	vfree(lts);
+
+	for (i = 0; i < sbi->num_lanes; i++)
+		if (sbi->lanes[i].journal->head != sbi->lanes[i].journal->tail)
+			pmfs_forward_journal(sb, &sbi->lanes[i]);
 	PERSISTENT_MARK();
 	PERSISTENT_BARRIER();
 	return 0;
@@ -842,20 +1778,41 @@ static int pmfs_recover_redo_journal(struct super_block *sb)
 int pmfs_recover_journal(struct super_block *sb)
 {
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
-	pmfs_journal_t *journal = pmfs_get_journal(sb);
-	uint32_t tail = le32_to_cpu(journal->tail);
-	uint32_t head = le32_to_cpu(journal->head);
-	uint16_t gen_id = le16_to_cpu(journal->gen_id);
+	pmfs_journal_t *journal;
+	uint32_t head, tail;
+	unsigned int i;
+	bool dirty = false;
+
+	for (i = 0; i < sbi->num_lanes; i++) {
+		journal = sbi->lanes[i].journal;
+		tail = le32_to_cpu(journal->tail);
+		head = le32_to_cpu(journal->head);
+
+		/* is the lane empty? true if unmounted properly. */
+		if (head == tail)
+			continue;
+		pmfs_dbg("PMFS: journal recovery. lane %u head:tail %x:%x "
+			"gen_id %d\n", i, head, tail,
+			le16_to_cpu(journal->gen_id));
+		dirty = true;
+	}
+
+	journal = pmfs_get_journal(sb);
+	if (le16_to_cpu(journal->log_format) != PMFS_LOG_FORMAT_PACKED) {
+		/* records in the old format cannot be read any more */
+		if (dirty) {
+			pmfs_err(sb, "journal in an old format needs recovery."
+				" Mount with the pmfs version that wrote it\n");
+			return -EINVAL;
+		}
+	} else if (dirty && pmfs_recover_lanes(sb)) {
+		return -ENOMEM;
+	}
 
-	/* is the journal empty? true if unmounted properly. */
-	if (head == tail)
+	/* an empty log in an older layout is reformatted once the file
+	 * system is writable. A read-only mount leaves it alone and
+	 * pmfs_remount() upgrades it on the way to read-write */
+	if (sb->s_flags & MS_RDONLY)
 		return 0;
-	pmfs_dbg("PMFS: journal recovery. head:tail %x:%x gen_id %d\n",
-		head, tail, gen_id);
-	if (sbi->redo_log)
-		pmfs_recover_redo_journal(sb);
-	else
-		pmfs_recover_undo_journal(sb);
-	return 0;
+	return pmfs_journal_upgrade(sb);
 }
-
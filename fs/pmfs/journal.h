@@ -18,6 +18,7 @@
 #ifndef __PMFS_JOURNAL_H__
 #define __PMFS_JOURNAL_H__
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 
 /* default pmfs journal size 4MB */
 #define PMFS_DEFAULT_JOURNAL_SIZE  (4 << 20)
@@ -29,6 +30,9 @@
 #define CACHELINE_MASK  (~(CACHELINE_SIZE - 1))
 #define CACHELINE_ALIGN(addr) (((addr)+CACHELINE_SIZE-1) & CACHELINE_MASK)
 
+/* Transactions reserve log space in log entries of LOGENTRY_SIZE bytes.
+ * The record for up to n * MAX_DATA_PER_LENTRY bytes never needs more than
+ * n of them, so the counts below are upper bounds. */
 #define LOGENTRY_SIZE  CACHELINE_SIZE
 #define LESIZE_SHIFT   CLINE_SHIFT
 
@@ -54,30 +58,138 @@
 #define LE_START       1
 #define LE_COMMIT      2
 #define LE_ABORT       4
+#define LE_REDO        8	/* new contents, redo log only */
 
 #define MAX_GEN_ID  ((uint16_t)-1)
 
-/* persistent data structure to describe a single log-entry */
-/* every log entry is max CACHELINE_SIZE bytes in size */
+/* The journal area is split into lanes, each an independent circular log
+ * with its own head, tail and gen_id. The first block of the area holds
+ * one pmfs_journal_t per cacheline describing each lane. */
+#define PMFS_MAX_LANES		64
+#define PMFS_MIN_LANE_SIZE	(1 << 15)
+#define PMFS_LANE_HDR_SIZE	PMFS_DEF_BLOCK_SIZE_4K
+
+/* a transaction short of log space rechecks every PMFS_JOURNAL_WAIT and
+ * gives up with -EAGAIN after PMFS_JOURNAL_WAIT_MAX without room */
+#define PMFS_JOURNAL_WAIT	(HZ / 100 + 1)
+#define PMFS_JOURNAL_WAIT_MAX	(10 * HZ)
+
+/* bounds on how long a lane's cleaner waits between runs */
+#define PMFS_CLEAN_MIN_DELAY	1
+#define PMFS_CLEAN_MAX_DELAY	HZ
+
+/* with group_commit, a leader that shared its last barrier waits this long
+ * for other committers to join the next group */
+#define PMFS_COMMIT_WINDOW_NS	2000
+
+/* layout of the records in the journal, kept in pmfs_journal_t.log_format */
+#define PMFS_LOG_FORMAT_FIXED	0	/* 64-byte log entries, no longer used */
+#define PMFS_LOG_FORMAT_PACKED	1
+
+/* persistent header of a log record. The records of a transaction are
+ * packed back to back on PMFS_LOGREC_ALIGN boundaries in the space it
+ * reserved, and every transaction starts on a LOGENTRY_SIZE boundary.
+ * A record is valid when its checksum matches. The checksum is seeded
+ * with the generation of the lane, so torn records and records left over
+ * from an earlier pass over the log both fail it.
+ *
+ * A data record is followed by nr_ranges pmfs_logrange_t and then by the
+ * contents of each range, in the same order. A commit record of a redo log
+ * is followed by the commit sequence number. */
+typedef struct {
+	__le32   csum;
+	__le16   size;	/* of the whole record, header included */
+	u8       type;	/* LE_* */
+	u8       nr_ranges;
+} pmfs_logrec_t;
+
+/* the block offset of a logged range in the low 48 bits, its length in
+ * the high 16 */
 typedef struct {
-	__le64   addr_offset;
-	__le32   transaction_id;
-	__le16   gen_id;
-	u8       type;  /* normal, commit, or abort */
-	u8       size;
-	char     data[48];
-} pmfs_logentry_t;
+	__le64   off_len;
+} pmfs_logrange_t;
+
+#define PMFS_LOGREC_ALIGN	8
+#define PMFS_LOGRANGE_SHIFT	48
+#define PMFS_LOGRANGE_OFF_MASK	((1ULL << PMFS_LOGRANGE_SHIFT) - 1)
+#define PMFS_MAX_LOGREC_SIZE	0xfff8
+#define PMFS_MAX_LOGREC_RANGES	255
+#define PMFS_LOG_STAGE_SIZE	256
+
+/* one range of a gather record passed to pmfs_add_logentries() */
+struct pmfs_log_range {
+	void		*addr;
+	uint16_t	size;
+};
+
+/* volatile data structure to describe a journal lane */
+struct pmfs_journal_lane {
+	pmfs_journal_t	*journal;	/* persistent head, tail and gen_id */
+	void		*base_addr;
+	uint32_t	jsize;
+	atomic_t	next_transaction_id;
+	struct mutex	clean_lock;	/* serializes cleaning */
+	/* reservations whose start record may not be visible yet; see
+	 * pmfs_reserve_log() */
+	atomic_t	nr_reserving;
+
+	/* cleaner, see pmfs_clean_lane_work() */
+	struct super_block	*sb;
+	struct delayed_work	clean_work;
+	unsigned long		clean_kicked;
+	unsigned long		clean_last;	/* jiffies of the last run */
+	uint32_t		clean_tail;	/* tail at the last run */
+	uint16_t		clean_gen_id;
+	unsigned long		fill_rate;	/* bytes per second */
+
+	/* statistics */
+	unsigned long		nr_cleans;
+	atomic_long_t		nr_sync_cleans;	/* by transactions short of log */
+	atomic_long_t		nr_waits;
+	u64			bytes_cleaned;
+	uint32_t		max_lag;	/* most bytes found uncleaned */
+} ____cacheline_aligned_in_smp;
+
+static inline uint32_t pmfs_lane_avail_size(struct pmfs_journal_lane *lane)
+{
+	uint32_t head = le32_to_cpu(lane->journal->head);
+	uint32_t tail = le32_to_cpu(lane->journal->tail);
+
+	return ((tail >= head) ? (lane->jsize - (tail - head)) :
+		(head - tail)) - LOGENTRY_SIZE;
+}
+
+static inline uint32_t pmfs_lane_used(struct pmfs_journal_lane *lane)
+{
+	return lane->jsize - LOGENTRY_SIZE - pmfs_lane_avail_size(lane);
+}
 
 /* volatile data structure to describe a transaction */
+/* cache lines a transaction modified, as an inclusive range of line
+ * numbers; see pmfs_dirty_range() */
+struct pmfs_dirty_lines {
+	unsigned long	first;
+	unsigned long	last;
+};
+
+#define PMFS_DIRTY_RANGES	16
+
 typedef struct pmfs_transaction {
 	u32              transaction_id;
-	u16              num_entries;
-	u16              num_used;
+	u32              size;		/* bytes of log reserved */
+	u32              used;		/* bytes of records written */
+	u32              fenced;	/* bytes of records fenced */
 	u16              gen_id;
 	u16              status;
 	pmfs_journal_t  *t_journal;
-	pmfs_logentry_t *start_addr;
+	void            *start_addr;
 	struct pmfs_transaction *parent;
+	struct list_head commit_list;	/* group commit queue */
+	u16              nr_dirty;
+	u32              flushed;	/* lines flushed early, set full */
+	struct pmfs_dirty_lines dirty[PMFS_DIRTY_RANGES];
+	/* records are built here before they are streamed into the log */
+	u64              log_stage[PMFS_LOG_STAGE_SIZE / sizeof(u64)];
 } pmfs_transaction_t;
 
 extern pmfs_transaction_t *pmfs_alloc_transaction(void);
@@ -87,11 +199,18 @@ extern int pmfs_journal_soft_init(struct super_block *sb);
 extern int pmfs_journal_hard_init(struct super_block *sb,
 		uint64_t base, uint32_t size);
 extern int pmfs_journal_uninit(struct super_block *sb);
+extern int pmfs_journal_resize(struct super_block *sb, uint32_t size);
+extern int pmfs_journal_upgrade(struct super_block *sb);
 extern pmfs_transaction_t *pmfs_new_transaction(struct super_block *sb,
 		int nclines);
 extern pmfs_transaction_t *pmfs_current_transaction(void);
+extern void pmfs_dirty_range(struct super_block *sb, void *addr,
+		uint32_t len);
 extern int pmfs_add_logentry(struct super_block *sb,
 		pmfs_transaction_t *trans, void *addr, uint16_t size, u8 type);
+extern int pmfs_add_logentries(struct super_block *sb,
+		pmfs_transaction_t *trans, const struct pmfs_log_range *ranges,
+		int nr, u8 type);
 extern int pmfs_commit_transaction(struct super_block *sb,
 		pmfs_transaction_t *trans);
 extern int pmfs_abort_transaction(struct super_block *sb,
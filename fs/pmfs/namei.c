@@ -500,8 +500,8 @@ static int pmfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	pmfs_memlock_range(sb, blk_base, sb->s_blocksize);
 
 	/* No need to journal the dir entries but we need to persist them */
-	pmfs_flush_buffer(blk_base, PMFS_DIR_REC_LEN(1) +
-			PMFS_DIR_REC_LEN(2), true);
+	pmfs_dirty_range(sb, blk_base, PMFS_DIR_REC_LEN(1) +
+			PMFS_DIR_REC_LEN(2));
 
 	set_nlink(inode, 2);
 
@@ -701,16 +701,18 @@ static int pmfs_rename(struct inode *old_dir,
 		if (err)
 			goto out;
 	} else {
-		pmfs_add_logentry(sb, trans, &new_de->ino, sizeof(new_de->ino),
-			LE_DATA);
+		struct pmfs_log_range ranges[2] = {
+			{ .addr = &new_de->ino, .size = sizeof(new_de->ino) },
+			{ .addr = new_pidir, .size = MAX_DATA_PER_LENTRY },
+		};
+
+		pmfs_add_logentries(sb, trans, ranges, 2, LE_DATA);
 
 		pmfs_memunlock_range(sb, new_de, sb->s_blocksize);
 		new_de->ino = cpu_to_le64(old_inode->i_ino);
 		/*new_de->file_type = old_de->file_type; */
 		pmfs_memlock_range(sb, new_de, sb->s_blocksize);
 
-		pmfs_add_logentry(sb, trans, new_pidir, MAX_DATA_PER_LENTRY,
-			LE_DATA);
 		/*new_dir->i_version++; */
 		new_dir->i_ctime = new_dir->i_mtime = CURRENT_TIME_SEC;
 		pmfs_update_time(new_dir, new_pidir);
@@ -0,0 +1,269 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Non-temporal zeroing and copying of persistent memory with SSE2 and AVX
+ * stores, and the mount-time benchmark that picks between them.
+ *
+ * Copyright 2012-2013 Intel Corporation
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/mm.h>
+#include <asm/i387.h>
+#include <asm/xcr.h>
+#include <asm/xsave.h>
+#include "pmfs.h"
+
+/* the FPU is held, and preemption disabled, for at most this many bytes */
+#define PMFS_NT_CHUNK		(256 << 10)
+
+/* the benchmark zeroes and fills this much free space per variant */
+#define PMFS_NT_BENCH_SIZE	(1 << 20)
+#define PMFS_NT_BENCH_SRC_ORDER	4
+
+int pmfs_nt_variant __read_mostly = PMFS_NT_MOVNTI;
+static bool pmfs_nt_usable[PMFS_NT_NR];
+
+static const char * const pmfs_nt_names[PMFS_NT_NR] = {
+	[PMFS_NT_MOVNTI]	= "movnti",
+	[PMFS_NT_SSE2]		= "sse2",
+	[PMFS_NT_AVX]		= "avx",
+};
+
+/* The SIMD kernels take a 32-byte aligned dest and a multiple of 64 bytes,
+ * and run between kernel_fpu_begin() and kernel_fpu_end(). */
+static void pmfs_memset_nt_sse2(void *dest, uint32_t dword, size_t len)
+{
+	asm volatile ("movd %[v], %%xmm0\n"
+		"pshufd $0, %%xmm0, %%xmm0\n"
+		"1:      movntdq %%xmm0, (%[d])\n"
+		"movntdq %%xmm0, 16(%[d])\n"
+		"movntdq %%xmm0, 32(%[d])\n"
+		"movntdq %%xmm0, 48(%[d])\n"
+		"leaq 64(%[d]), %[d]\n"
+		"subq $64, %[n]\n"
+		"jnz 1b\n"
+		: [d] "+r" (dest), [n] "+r" (len) : [v] "r" (dword) : "memory");
+}
+
+static void pmfs_memcpy_nt_sse2(void *dest, const void *src, size_t len)
+{
+	asm volatile ("1:      movdqu (%[s]), %%xmm0\n"
+		"movdqu 16(%[s]), %%xmm1\n"
+		"movdqu 32(%[s]), %%xmm2\n"
+		"movdqu 48(%[s]), %%xmm3\n"
+		"movntdq %%xmm0, (%[d])\n"
+		"movntdq %%xmm1, 16(%[d])\n"
+		"movntdq %%xmm2, 32(%[d])\n"
+		"movntdq %%xmm3, 48(%[d])\n"
+		"leaq 64(%[s]), %[s]\n"
+		"leaq 64(%[d]), %[d]\n"
+		"subq $64, %[n]\n"
+		"jnz 1b\n"
+		: [d] "+r" (dest), [s] "+r" (src), [n] "+r" (len) : : "memory");
+}
+
+#ifdef CONFIG_AS_AVX
+static void pmfs_memset_nt_avx(void *dest, uint32_t dword, size_t len)
+{
+	asm volatile ("vmovd %[v], %%xmm0\n"
+		"vpshufd $0, %%xmm0, %%xmm0\n"
+		"vinsertf128 $1, %%xmm0, %%ymm0, %%ymm0\n"
+		"1:      vmovntdq %%ymm0, (%[d])\n"
+		"vmovntdq %%ymm0, 32(%[d])\n"
+		"leaq 64(%[d]), %[d]\n"
+		"subq $64, %[n]\n"
+		"jnz 1b\n"
+		"vzeroupper\n"
+		: [d] "+r" (dest), [n] "+r" (len) : [v] "r" (dword) : "memory");
+}
+
+static void pmfs_memcpy_nt_avx(void *dest, const void *src, size_t len)
+{
+	asm volatile ("1:      vmovdqu (%[s]), %%ymm0\n"
+		"vmovdqu 32(%[s]), %%ymm1\n"
+		"vmovntdq %%ymm0, (%[d])\n"
+		"vmovntdq %%ymm1, 32(%[d])\n"
+		"leaq 64(%[s]), %[s]\n"
+		"leaq 64(%[d]), %[d]\n"
+		"subq $64, %[n]\n"
+		"jnz 1b\n"
+		"vzeroupper\n"
+		: [d] "+r" (dest), [s] "+r" (src), [n] "+r" (len) : : "memory");
+}
+
+static bool pmfs_avx_usable(void)
+{
+	u64 xcr0;
+
+	if (!cpu_has_avx || !cpu_has_osxsave)
+		return false;
+	xcr0 = xgetbv(XCR_XFEATURE_ENABLED_MASK);
+	return (xcr0 & (XSTATE_SSE | XSTATE_YMM)) ==
+		(XSTATE_SSE | XSTATE_YMM);
+}
+#else
+#define pmfs_memset_nt_avx	pmfs_memset_nt_sse2
+#define pmfs_memcpy_nt_avx	pmfs_memcpy_nt_sse2
+static inline bool pmfs_avx_usable(void) { return false; }
+#endif
+
+/* The unaligned head and the tail go through movnti, the rest through the
+ * SIMD kernel of variant v in chunks of at most PMFS_NT_CHUNK. movnti is
+ * also used where the FPU cannot be, e.g. in an interrupt that came in
+ * while it was in use. */
+static void pmfs_memset_nt_variant(int v, void *dest, uint32_t dword,
+	size_t len)
+{
+	size_t head = -(unsigned long)dest & 31, n;
+
+	if (v == PMFS_NT_MOVNTI || len < head + 64 || !irq_fpu_usable()) {
+		__memset_nt(dest, dword, len);
+		return;
+	}
+	__memset_nt(dest, dword, head);
+	dest += head;
+	len -= head;
+	while (len >= 64) {
+		n = min_t(size_t, len, PMFS_NT_CHUNK) & ~63UL;
+		kernel_fpu_begin();
+		if (v == PMFS_NT_AVX)
+			pmfs_memset_nt_avx(dest, dword, n);
+		else
+			pmfs_memset_nt_sse2(dest, dword, n);
+		kernel_fpu_end();
+		dest += n;
+		len -= n;
+	}
+	__memset_nt(dest, dword, len);
+}
+
+static void pmfs_memcpy_nt_variant(int v, void *dest, const void *src,
+	size_t len)
+{
+	size_t head = -(unsigned long)dest & 31, n;
+
+	if (v == PMFS_NT_MOVNTI || len < head + 64 || !irq_fpu_usable()) {
+		__memcpy_nt(dest, src, len);
+		return;
+	}
+	__memcpy_nt(dest, src, head);
+	dest += head;
+	src += head;
+	len -= head;
+	while (len >= 64) {
+		n = min_t(size_t, len, PMFS_NT_CHUNK) & ~63UL;
+		kernel_fpu_begin();
+		if (v == PMFS_NT_AVX)
+			pmfs_memcpy_nt_avx(dest, src, n);
+		else
+			pmfs_memcpy_nt_sse2(dest, src, n);
+		kernel_fpu_end();
+		dest += n;
+		src += n;
+		len -= n;
+	}
+	__memcpy_nt(dest, src, len);
+}
+
+void pmfs_memset_nt_simd(void *dest, uint32_t dword, size_t length)
+{
+	pmfs_memset_nt_variant(ACCESS_ONCE(pmfs_nt_variant), dest, dword,
+		length);
+}
+
+void pmfs_memcpy_nt_simd(void *dest, const void *src, size_t length)
+{
+	pmfs_memcpy_nt_variant(ACCESS_ONCE(pmfs_nt_variant), dest, src,
+		length);
+}
+
+/* Called at module load: the widest stores the CPU has are used until a
+ * mount has measured them. */
+void pmfs_select_nt(void)
+{
+	pmfs_nt_usable[PMFS_NT_MOVNTI] = true;
+	pmfs_nt_usable[PMFS_NT_SSE2] = true;
+	pmfs_nt_usable[PMFS_NT_AVX] = pmfs_avx_usable();
+	pmfs_nt_variant = pmfs_nt_usable[PMFS_NT_AVX] ? PMFS_NT_AVX :
+		PMFS_NT_SSE2;
+}
+
+/* MB/s for len bytes in ns nanoseconds */
+static inline unsigned long pmfs_nt_mbps(size_t len, u64 ns)
+{
+	return div64_u64((u64)len * 1000, max_t(u64, ns, 1));
+}
+
+/* Times every usable variant zeroing and filling a run of free blocks, and
+ * switches to the one with the best combined time. The choice is global,
+ * so the last mount to measure wins. Read-only mounts, and mounts without
+ * the free space, keep the current choice. */
+void pmfs_nt_benchmark(struct super_block *sb)
+{
+	unsigned long blocknr, src_page;
+	u64 start, zero_ns, copy_ns;
+	u64 best_ns = ULLONG_MAX, best_zero = 0, best_copy = 0;
+	size_t src_size = PAGE_SIZE << PMFS_NT_BENCH_SRC_ORDER;
+	unsigned int num = PMFS_NT_BENCH_SIZE >> PAGE_SHIFT;
+	int v, best = pmfs_nt_variant, allocated;
+	size_t off;
+	void *bp;
+
+	if (sb->s_flags & MS_RDONLY)
+		return;
+	src_page = __get_free_pages(GFP_KERNEL, PMFS_NT_BENCH_SRC_ORDER);
+	if (!src_page)
+		return;
+	memset((void *)src_page, 0x5a, src_size);
+	allocated = pmfs_new_blocks(sb, &blocknr, num, PMFS_BLOCK_TYPE_4K, 0,
+		0);
+	if (allocated < 0)
+		goto out;
+	if (allocated < num)
+		goto out_free;
+	bp = pmfs_get_block(sb, pmfs_get_block_off(sb, blocknr,
+		PMFS_BLOCK_TYPE_4K));
+
+	for (v = 0; v < PMFS_NT_NR; v++) {
+		if (!pmfs_nt_usable[v])
+			continue;
+		pmfs_memunlock_range(sb, bp, PMFS_NT_BENCH_SIZE);
+		start = local_clock();
+		pmfs_memset_nt_variant(v, bp, 0, PMFS_NT_BENCH_SIZE);
+		PERSISTENT_BARRIER();
+		zero_ns = local_clock() - start;
+		start = local_clock();
+		for (off = 0; off < PMFS_NT_BENCH_SIZE; off += src_size)
+			pmfs_memcpy_nt_variant(v, bp + off,
+				(void *)src_page, src_size);
+		PERSISTENT_BARRIER();
+		copy_ns = local_clock() - start;
+		pmfs_memlock_range(sb, bp, PMFS_NT_BENCH_SIZE);
+		pmfs_dbg_verbose("%s: zero %lu MB/s, copy %lu MB/s\n",
+			pmfs_nt_names[v],
+			pmfs_nt_mbps(PMFS_NT_BENCH_SIZE, zero_ns),
+			pmfs_nt_mbps(PMFS_NT_BENCH_SIZE, copy_ns));
+		if (zero_ns + copy_ns < best_ns) {
+			best_ns = zero_ns + copy_ns;
+			best_zero = zero_ns;
+			best_copy = copy_ns;
+			best = v;
+		}
+	}
+	pmfs_nt_variant = best;
+	pmfs_info("PMFS: non-temporal stores with %s, zeroing %lu MB/s, "
+		"copying %lu MB/s\n", pmfs_nt_names[best],
+		pmfs_nt_mbps(PMFS_NT_BENCH_SIZE, best_zero),
+		pmfs_nt_mbps(PMFS_NT_BENCH_SIZE, best_copy));
+out_free:
+	pmfs_free_blocks(sb, blocknr, allocated, PMFS_BLOCK_TYPE_4K);
+out:
+	free_pages(src_page, PMFS_NT_BENCH_SRC_ORDER);
+}
@@ -18,7 +18,12 @@
 #include <linux/pmfs_def.h>
 #include <linux/crc16.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/jump_label.h>
+#include <linux/spinlock.h>
 #include <linux/pagemap.h>
+#include <linux/rbtree.h>
 #include <linux/rcupdate.h>
 #include <linux/types.h>
 
@@ -55,6 +60,7 @@ extern unsigned int pmfs_dbgmask;
 #define PMFS_DBGMASK_MMAPVVERBOSE      (0x00000008)
 #define PMFS_DBGMASK_VERBOSE           (0x00000010)
 #define PMFS_DBGMASK_TRANSACTION       (0x00000020)
+#define PMFS_DBGMASK_LOGORDER          (0x00000040)
 
 #define pmfs_dbg_mmaphuge(s, args ...)		 \
 	((pmfs_dbgmask & PMFS_DBGMASK_MMAPHUGE) ? pmfs_dbg(s, args) : 0)
@@ -98,11 +104,20 @@ extern unsigned int pmfs_dbgmask;
 #define PMFS_OTHER_FLMASK (FS_NODUMP_FL | FS_NOATIME_FL)
 #define PMFS_FL_USER_VISIBLE (FS_FL_USER_VISIBLE | PMFS_EOFBLOCKS_FL)
 
+/* Migrate a regular file to larger data blocks; the argument points to the
+ * new PMFS_BLOCK_TYPE_* */
+#define PMFS_IOC_DEFRAG		_IOW('p', 1, unsigned int)
+
 #define INODES_PER_BLOCK(bt) (1 << (blk_type_to_shift[bt] - PMFS_INODE_BITS))
 
 extern unsigned int blk_type_to_shift[PMFS_BLOCK_TYPE_MAX];
 extern unsigned int blk_type_to_size[PMFS_BLOCK_TYPE_MAX];
 
+struct pmfs_inode_info;
+struct pmfs_free_batch;
+struct pmfs_range;
+struct dentry;
+
 /* Function Prototypes */
 extern void pmfs_error_mng(struct super_block *sb, const char *fmt, ...);
 
@@ -115,13 +130,58 @@ extern struct pmfs_blocknode *pmfs_alloc_blocknode(struct super_block *sb);
 extern void pmfs_free_blocknode(struct super_block *sb, struct pmfs_blocknode *bnode);
 extern void pmfs_init_blockmap(struct super_block *sb,
 		unsigned long init_used_size);
+extern void pmfs_insert_blocknode(struct super_block *sb,
+	struct pmfs_blocknode *i, struct pmfs_blocknode *prev);
+extern int __pmfs_reserve_blocks(struct super_block *sb, unsigned long low,
+	unsigned long high);
 extern void pmfs_free_block(struct super_block *sb, unsigned long blocknr,
 	unsigned short btype);
+extern void pmfs_free_blocks(struct super_block *sb, unsigned long blocknr,
+	unsigned long num, unsigned short btype);
+extern void pmfs_zero_blocks(struct super_block *sb, unsigned long blocknr,
+	unsigned long num, unsigned short btype);
+extern void pmfs_free_batch_add(struct super_block *sb,
+	struct pmfs_free_batch *batch, unsigned long blocknr,
+	unsigned long num);
+extern void pmfs_free_batch_flush(struct super_block *sb,
+	struct pmfs_free_batch *batch);
 extern void __pmfs_free_block(struct super_block *sb, unsigned long blocknr,
 	unsigned short btype, struct pmfs_blocknode **start_hint);
 extern int pmfs_new_block(struct super_block *sb, unsigned long *blocknr,
 	unsigned short btype, int zero);
+extern int pmfs_new_blocks(struct super_block *sb, unsigned long *blocknr,
+	unsigned int num, unsigned short btype, int zero, unsigned long goal);
 extern unsigned long pmfs_count_free_blocks(struct super_block *sb);
+extern int pmfs_init_free_pools(struct super_block *sb);
+extern void pmfs_drain_free_pools(struct super_block *sb);
+extern void pmfs_destroy_free_pools(struct super_block *sb);
+extern void pmfs_drain_zero_pools(struct super_block *sb);
+extern void pmfs_start_zero_thread(struct super_block *sb);
+extern void pmfs_stop_zero_thread(struct super_block *sb);
+
+/* nt.c */
+#define PMFS_NT_SIMD_MIN	4096
+
+enum {
+	PMFS_NT_MOVNTI,
+	PMFS_NT_SSE2,
+	PMFS_NT_AVX,
+	PMFS_NT_NR
+};
+
+extern int pmfs_nt_variant;
+extern void pmfs_memset_nt_simd(void *dest, uint32_t dword, size_t length);
+extern void pmfs_memcpy_nt_simd(void *dest, const void *src, size_t length);
+extern void pmfs_select_nt(void);
+extern void pmfs_nt_benchmark(struct super_block *sb);
+
+/* stats.c */
+extern int pmfs_init_stats(struct super_block *sb);
+extern void pmfs_register_stats(struct super_block *sb);
+extern void pmfs_destroy_stats(struct super_block *sb);
+extern void pmfs_record_latency(struct super_block *sb, int type, u64 start);
+extern void pmfs_init_debugfs(void);
+extern void pmfs_destroy_debugfs(void);
 
 /* dir.c */
 extern int pmfs_add_entry(pmfs_transaction_t *trans,
@@ -137,15 +197,22 @@ extern unsigned int pmfs_free_inode_subtree(struct super_block *sb,
 		__le64 root, u32 height, u32 btype, unsigned long last_blocknr);
 extern int __pmfs_alloc_blocks(pmfs_transaction_t *trans,
 		struct super_block *sb, struct pmfs_inode *pi,
-		unsigned long file_blocknr, unsigned int num, bool zero);
+		struct pmfs_inode_info *si, unsigned long file_blocknr,
+		unsigned int num, bool zero);
 extern int pmfs_init_inode_table(struct super_block *sb);
 extern int pmfs_alloc_blocks(pmfs_transaction_t *trans, struct inode *inode,
 		unsigned long file_blocknr, unsigned int num, bool zero);
 extern u64 pmfs_find_data_block(struct inode *inode,
 	unsigned long file_blocknr);
+extern void pmfs_discard_prealloc(struct inode *inode);
+extern int pmfs_migrate_blocks(struct inode *inode, unsigned short btype);
+extern void pmfs_discard_all_prealloc(struct super_block *sb);
 int pmfs_set_blocksize_hint(struct super_block *sb, struct pmfs_inode *pi,
 		loff_t new_size);
 void pmfs_setsize(struct inode *inode, loff_t newsize);
+extern void pmfs_range_lock(struct inode *inode, struct pmfs_range *range,
+		loff_t start, loff_t end);
+extern void pmfs_range_unlock(struct inode *inode, struct pmfs_range *range);
 
 extern struct inode *pmfs_iget(struct super_block *sb, unsigned long ino);
 extern void pmfs_put_inode(struct inode *inode);
@@ -184,15 +251,54 @@ extern struct super_block *pmfs_read_super(struct super_block *sb, void *data,
 extern int pmfs_statfs(struct dentry *d, struct kstatfs *buf);
 extern int pmfs_remount(struct super_block *sb, int *flags, char *data);
 
-/* Provides ordering from all previous clflush too */
+/* Cache line flushes are done with clwb or clflushopt where the CPU has
+ * them, else with clflush. The choice is made once at module load. */
+extern struct static_key pmfs_clwb_key;
+extern struct static_key pmfs_clflushopt_key;
+extern void pmfs_select_flush(void);
+extern const char *pmfs_flush_name(void);
+
+/* clwb and clflushopt are spelled out for assemblers that predate them */
+static inline void pmfs_flush_line(void *p)
+{
+	if (static_key_false(&pmfs_clwb_key))
+		asm volatile (".byte 0x66, 0x0f, 0xae, 0x30\n"
+			: "+m" (*(volatile char *)p) : "a" (p));
+	else if (static_key_false(&pmfs_clflushopt_key))
+		asm volatile (".byte 0x66, 0x0f, 0xae, 0x38\n"
+			: "+m" (*(volatile char *)p) : "a" (p));
+	else
+		asm volatile ("clflush %0\n" : "+m" (*(volatile char *)p));
+}
+
+/* Provides ordering from all previous flushes too. clflush is ordered
+ * with later stores already; clwb and clflushopt are not. */
 static inline void PERSISTENT_MARK(void)
 {
-	/* TODO: Fix me. */
+	if (static_key_false(&pmfs_clwb_key) ||
+	    static_key_false(&pmfs_clflushopt_key))
+		asm volatile ("sfence\n" : : : "memory");
+}
+
+/* PM latency emulation for running on DRAM (pm_wlat=, pm_fence=, pm_bw=).
+ * The flush helpers have no superblock, so the delays are global and set
+ * by the most recent mount asking for them. */
+extern struct static_key pmfs_emul_key;
+extern void pmfs_emul_write(unsigned long lines);
+extern void pmfs_emul_fence(void);
+
+/* charges len bytes of non-temporal stores */
+static inline void pmfs_emul_store(size_t len)
+{
+	if (static_key_false(&pmfs_emul_key))
+		pmfs_emul_write(DIV_ROUND_UP(len, CACHELINE_SIZE));
 }
 
 static inline void PERSISTENT_BARRIER(void)
 {
 	asm volatile ("sfence\n" : : );
+	if (static_key_false(&pmfs_emul_key))
+		pmfs_emul_fence();
 }
 
 static inline void pmfs_flush_buffer(void *buf, uint32_t len, bool fence)
@@ -200,13 +306,15 @@ static inline void pmfs_flush_buffer(void *buf, uint32_t len, bool fence)
 	uint32_t i;
 	len = len + ((unsigned long)(buf) & (CACHELINE_SIZE - 1));
 	for (i = 0; i < len; i += CACHELINE_SIZE)
-		asm volatile ("clflush %0\n" : "+m" (*(char *)(buf+i)));
+		pmfs_flush_line(buf + i);
+	if (static_key_false(&pmfs_emul_key))
+		pmfs_emul_write(DIV_ROUND_UP(len, CACHELINE_SIZE));
 	/* Do a fence only if asked. We often don't need to do a fence
-	 * immediately after clflush because even if we get context switched
-	 * between clflush and subsequent fence, the context switch operation
-	 * provides implicit fence. */
+	 * immediately after a flush because even if we get context switched
+	 * between the flush and subsequent fence, the context switch
+	 * operation provides implicit fence. */
 	if (fence)
-		asm volatile ("sfence\n" : : );
+		PERSISTENT_BARRIER();
 }
 
 /* symlink.c */
@@ -243,15 +351,139 @@ struct pmfs_blocknode_lowhigh {
        __le64 block_high;
 };
                
+/* aligned huge regions tracked by the allocator: 2M and 1G */
+#define PMFS_NR_REGIONS		2
+
 struct pmfs_blocknode {
 	struct list_head link;
+	struct rb_node node;		/* in block_inuse_tree */
 	unsigned long block_low;
 	unsigned long block_high;
+	unsigned long gap;		/* free blocks after block_high */
+	unsigned long subtree_gap;	/* largest gap in this subtree */
+	/* free blocks of the gap in partly used 2M/1G regions */
+	unsigned long room[PMFS_NR_REGIONS];
+	unsigned long subtree_room[PMFS_NR_REGIONS];
+	/* free blocks of the gap from its first 2M/1G boundary on */
+	unsigned long aligned[PMFS_NR_REGIONS];
+	unsigned long subtree_aligned[PMFS_NR_REGIONS];
+	/* whole free aligned 2M/1G regions in the gap */
+	unsigned long nr_free_regions[PMFS_NR_REGIONS];
+};
+
+/*
+ * Per-CPU cache of free 4K blocks. It holds one contiguous extent carved out
+ * of the global free space plus a small stack of recently freed blocks, and
+ * is refilled/drained in batches of PMFS_POOL_BATCH blocks under s_lock.
+ */
+#define PMFS_POOL_BATCH		32
+#define PMFS_POOL_MAX_FREED	(2 * PMFS_POOL_BATCH)
+
+struct pmfs_free_pool {
+	spinlock_t	lock;
+	unsigned long	ext_low;	/* next free block of the extent */
+	unsigned long	ext_end;	/* one past the last block of the extent */
+	unsigned int	nr_freed;
+	unsigned long	freed[PMFS_POOL_MAX_FREED];
+};
+
+struct pmfs_extent {
+	unsigned long	blocknr;
+	unsigned long	num;
+};
+
+/*
+ * Extents of free blocks already cleared by the zeroing thread, one pool
+ * for each of the 4K and 2M block types.  Counts are in blocks of the
+ * pool's type.
+ */
+#define PMFS_NR_ZERO_POOLS	2
+#define PMFS_ZERO_POOL_EXTENTS	32
+/* how long a refill that found no free run waits before trying again */
+#define PMFS_ZERO_RETRY_DELAY	HZ
+
+struct pmfs_zero_pool {
+	spinlock_t	lock;
+	unsigned int	nr_extents;
+	unsigned long	nr_blocks;
+	bool		stalled;	/* the last refill found no free run */
+	struct pmfs_extent ext[PMFS_ZERO_POOL_EXTENTS];
+};
+
+/*
+ * Blocks released by truncate, gathered into extents of 4K blocks so that
+ * they go back to the block map in a few sorted passes under s_lock.
+ */
+#define PMFS_FREE_BATCH		32
+
+struct pmfs_free_batch {
+	unsigned int	nr;
+	struct pmfs_extent ext[PMFS_FREE_BATCH];
+};
+
+/*
+ * Allocator latency histograms, kept per CPU.  Bucket b counts the calls
+ * that took [2^(b-1), 2^b) ns; the last bucket also takes anything slower.
+ */
+#define PMFS_LAT_BUCKETS	32
+
+enum {
+	PMFS_LAT_NEW_BLOCK,
+	PMFS_LAT_FREE_BLOCK,
+	PMFS_NR_LAT
+};
+
+struct pmfs_alloc_stats {
+	unsigned long	lat[PMFS_NR_LAT][PMFS_LAT_BUCKETS];
+};
+
+/* cache lines flushed per transaction, in power-of-two buckets */
+#define PMFS_FLUSH_BUCKETS	12
+
+struct pmfs_flush_stats {
+	unsigned long	lines;
+	unsigned long	per_trans[PMFS_FLUSH_BUCKETS];
+};
+
+/*
+ * Preallocation window of a 4K-block file that keeps growing sequentially.
+ * Blocks in [i_prealloc_start, i_prealloc_end) are taken from the block
+ * map but not yet linked into the file; the next window is i_prealloc_size
+ * blocks, doubling from PMFS_PREALLOC_MIN up to PMFS_PREALLOC_MAX.
+ */
+#define PMFS_PREALLOC_MIN	16
+#define PMFS_PREALLOC_MAX	2048
+
+/*
+ * Byte-range lock of a file's data. Writers that only overwrite allocated
+ * blocks take just their range; everything that allocates, frees or moves
+ * blocks also holds i_mutex. Held ranges live on the holders' stacks.
+ */
+struct pmfs_range_lock {
+	spinlock_t	lock;
+	struct list_head ranges;
+	wait_queue_head_t wait;
+};
+
+/* [start, end) */
+struct pmfs_range {
+	struct list_head list;
+	loff_t		start;
+	loff_t		end;
 };
 
 struct pmfs_inode_info {
 	__u32   i_dir_start_lookup;
 	struct list_head i_truncated;
+	/* protected by sbi->s_prealloc_lock */
+	unsigned long	i_prealloc_start;
+	unsigned long	i_prealloc_end;
+	unsigned long	i_prealloc_size;
+	struct list_head i_prealloc_list;
+	struct pmfs_range_lock i_range_lock;
+	/* held for write while the root, height or meta blocks of the
+	 * b-tree change, and for read by walks without i_mutex */
+	struct rw_semaphore i_tree_sem;
 	struct inode	vfs_inode;
 };
 
@@ -266,10 +498,24 @@ struct pmfs_sb_info {
 	phys_addr_t	phys_addr;
 	void		*virt_addr;
 	struct list_head block_inuse_head;
+	struct rb_root	block_inuse_tree;
 	unsigned long	block_start;
 	unsigned long	block_end;
 	unsigned long	num_free_blocks;
+	/* free aligned 2M and 1G regions in the block map */
+	unsigned long	num_free_regions[PMFS_NR_REGIONS];
 	struct mutex 	s_lock;	/* protects the SB's buffer-head */
+	struct pmfs_free_pool __percpu *free_pools;
+	struct pmfs_zero_pool zero_pools[PMFS_NR_ZERO_POOLS];
+	struct task_struct *zero_thread;
+	wait_queue_head_t  zero_wait;
+	/* inodes holding preallocation windows, and their total size */
+	spinlock_t	s_prealloc_lock;
+	struct list_head s_prealloc_list;
+	unsigned long	num_prealloc_blocks;
+	struct pmfs_alloc_stats __percpu *alloc_stats;
+	struct pmfs_flush_stats __percpu *flush_stats;
+	struct dentry	*debugfs_dir;
 
 	/*
 	 * Backing store option:
@@ -287,6 +533,11 @@ struct pmfs_sb_info {
 	kuid_t		uid;    /* Mount uid for root directory */
 	kgid_t		gid;    /* Mount gid for root directory */
 	umode_t		mode;   /* Mount mode for root directory */
+	/* PM emulation: ns per line written, ns per fence, MB/s cap */
+	unsigned int	emul_wlat;
+	unsigned int	emul_fence;
+	unsigned int	emul_bw;
+	bool		emul_on;
 	atomic_t	next_generation;
 	/* inode tracking */
 	struct mutex inode_table_mutex;
@@ -298,13 +549,19 @@ struct pmfs_sb_info {
 	unsigned long num_blocknode_allocated;
 
 	/* Journaling related structures */
-	uint32_t    next_transaction_id;
 	uint32_t    jsize;
-	void       *journal_base_addr;
-	struct mutex journal_mutex;
-	struct task_struct *log_cleaner_thread;
-	wait_queue_head_t  log_cleaner_wait;
+	unsigned int num_lanes;
+	struct pmfs_journal_lane *lanes;
+	struct workqueue_struct *clean_wq;
+	struct percpu_rw_semaphore journal_sem; /* held off by a resize */
+	wait_queue_head_t  journal_space_wait;
+	spinlock_t	commit_lock;
+	struct list_head commit_pending;
+	unsigned int	commit_nr_pending;
+	unsigned int	commit_last_group;
+	bool		commit_leader;
 	bool redo_log;
+	atomic64_t commit_seq;	/* orders redo log commits across lanes */
 
 	/* truncate list related structures */
 	struct list_head s_truncate;
@@ -413,7 +670,7 @@ static inline void pmfs_update_time_and_size(struct inode *inode,
 }
 
 /* assumes the length to be 4-byte aligned */
-static inline void memset_nt(void *dest, uint32_t dword, size_t length)
+static inline void __memset_nt(void *dest, uint32_t dword, size_t length)
 {
 	uint64_t dummy1, dummy2;
 	uint64_t qword = ((uint64_t)dword << 32) | dword;
@@ -449,6 +706,37 @@ static inline void memset_nt(void *dest, uint32_t dword, size_t length)
 		: "=D"(dummy1), "=d" (dummy2) : "D" (dest), "a" (qword), "d" (length) : "memory", "rcx");
 }
 
+/* assumes dest to be 8-byte aligned and the length a multiple of 8 */
+static inline void __memcpy_nt(void *dest, const void *src, size_t length)
+{
+	uint64_t *d = dest;
+	const uint64_t *s = src;
+	size_t i;
+
+	for (i = 0; i < length / sizeof(uint64_t); i++)
+		asm volatile ("movnti %1,%0\n" : "=m" (d[i]) : "r" (s[i]));
+}
+
+/* Below PMFS_NT_SIMD_MIN bytes, saving the FPU state costs more than the
+ * wider stores gain, so short runs always use movnti. */
+static inline void memset_nt(void *dest, uint32_t dword, size_t length)
+{
+	if (length >= PMFS_NT_SIMD_MIN && pmfs_nt_variant != PMFS_NT_MOVNTI)
+		pmfs_memset_nt_simd(dest, dword, length);
+	else
+		__memset_nt(dest, dword, length);
+	pmfs_emul_store(length);
+}
+
+static inline void memcpy_nt(void *dest, const void *src, size_t length)
+{
+	if (length >= PMFS_NT_SIMD_MIN && pmfs_nt_variant != PMFS_NT_MOVNTI)
+		pmfs_memcpy_nt_simd(dest, src, length);
+	else
+		__memcpy_nt(dest, src, length);
+	pmfs_emul_store(length);
+}
+
 static inline u64 __pmfs_find_data_block(struct super_block *sb,
 		struct pmfs_inode *pi, unsigned long blocknr)
 {
@@ -552,6 +840,14 @@ static inline int pmfs_is_mounting(struct super_block *sb)
 	return sbi->s_mount_opt & PMFS_MOUNT_MOUNTING;
 }
 
+/* 4K blocks go through the per-CPU pools once the block map is built */
+static inline bool pmfs_use_free_pool(struct super_block *sb,
+	unsigned short btype)
+{
+	return btype == PMFS_BLOCK_TYPE_4K && PMFS_SB(sb)->free_pools &&
+		!pmfs_is_mounting(sb);
+}
+
 static inline struct pmfs_inode_truncate_item * pmfs_get_truncate_item (struct 
 		super_block *sb, u64 ino)
 {
@@ -0,0 +1,225 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Allocator and journal statistics exported through debugfs.
+ *
+ * Copyright 2012-2013 Intel Corporation
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched.h>
+#include <linux/log2.h>
+#include "pmfs.h"
+#include "journal.h"
+
+/* free extents are counted in power-of-two size buckets, in 4K blocks, up
+ * to and including the size of a 1G block */
+#define PMFS_EXTENT_BUCKETS	20
+
+static const char * const pmfs_lat_names[PMFS_NR_LAT] = {
+	[PMFS_LAT_NEW_BLOCK]	= "new_block",
+	[PMFS_LAT_FREE_BLOCK]	= "free_block",
+};
+
+static struct dentry *pmfs_debugfs_root;
+
+void pmfs_record_latency(struct super_block *sb, int type, u64 start)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	u64 ns = local_clock() - start;
+	int bucket = ns ? ilog2(ns) + 1 : 0;
+
+	if (!sbi->alloc_stats)
+		return;
+	if (bucket >= PMFS_LAT_BUCKETS)
+		bucket = PMFS_LAT_BUCKETS - 1;
+	this_cpu_inc(sbi->alloc_stats->lat[type][bucket]);
+}
+
+static int pmfs_alloc_stats_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	unsigned long extents[PMFS_EXTENT_BUCKETS] = { 0 };
+	unsigned long lat[PMFS_LAT_BUCKETS];
+	unsigned long nr_blocknodes, nr_extents = 0, num_free;
+	unsigned long nr_regions[PMFS_NR_REGIONS];
+	struct pmfs_blocknode *i;
+	int b, type, cpu;
+
+	mutex_lock(&sbi->s_lock);
+	list_for_each_entry(i, &sbi->block_inuse_head, link) {
+		if (!i->gap)
+			continue;
+		b = ilog2(i->gap);
+		extents[min(b, PMFS_EXTENT_BUCKETS - 1)]++;
+		nr_extents++;
+	}
+	nr_blocknodes = sbi->num_blocknode_allocated;
+	for (b = 0; b < PMFS_NR_REGIONS; b++)
+		nr_regions[b] = sbi->num_free_regions[b];
+	mutex_unlock(&sbi->s_lock);
+	num_free = pmfs_count_free_blocks(sb);
+
+	seq_printf(seq, "blocknodes: %lu\n", nr_blocknodes);
+	seq_printf(seq, "free_blocks: %lu\n", num_free);
+	seq_printf(seq, "free_extents: %lu\n", nr_extents);
+	seq_printf(seq, "free_2M_regions: %lu\n", nr_regions[0]);
+	seq_printf(seq, "free_1G_regions: %lu\n", nr_regions[1]);
+
+	seq_puts(seq, "free_extent_blocks:\n");
+	for (b = 0; b < PMFS_EXTENT_BUCKETS; b++)
+		seq_printf(seq, "  %8lu: %lu\n", 1UL << b, extents[b]);
+
+	for (type = 0; type < PMFS_NR_LAT; type++) {
+		memset(lat, 0, sizeof(lat));
+		if (sbi->alloc_stats) {
+			for_each_possible_cpu(cpu)
+				for (b = 0; b < PMFS_LAT_BUCKETS; b++)
+					lat[b] += per_cpu_ptr(sbi->alloc_stats,
+							cpu)->lat[type][b];
+		}
+		seq_printf(seq, "%s_latency_ns:\n", pmfs_lat_names[type]);
+		for (b = 0; b < PMFS_LAT_BUCKETS; b++)
+			if (lat[b])
+				seq_printf(seq, "  %10llu: %lu\n",
+					   b ? 1ULL << (b - 1) : 0ULL, lat[b]);
+	}
+	return 0;
+}
+
+static int pmfs_alloc_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pmfs_alloc_stats_show, inode->i_private);
+}
+
+static const struct file_operations pmfs_alloc_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pmfs_alloc_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* the lag of a lane is how much of its log has not been cleaned yet */
+static int pmfs_journal_stats_show(struct seq_file *seq, void *v)
+{
+	struct super_block *sb = seq->private;
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	struct pmfs_journal_lane *lane;
+	unsigned long flush[PMFS_FLUSH_BUCKETS] = { 0 }, lines = 0;
+	unsigned int i;
+	int b, cpu;
+
+	if (sbi->flush_stats) {
+		for_each_possible_cpu(cpu) {
+			struct pmfs_flush_stats *fs =
+				per_cpu_ptr(sbi->flush_stats, cpu);
+
+			lines += fs->lines;
+			for (b = 0; b < PMFS_FLUSH_BUCKETS; b++)
+				flush[b] += fs->per_trans[b];
+		}
+	}
+	seq_printf(seq, "flushed_lines: %lu\n", lines);
+	seq_puts(seq, "lines_per_transaction:\n");
+	for (b = 0; b < PMFS_FLUSH_BUCKETS; b++)
+		if (flush[b])
+			seq_printf(seq, "  %6lu: %lu\n",
+				   b ? 1UL << (b - 1) : 0UL, flush[b]);
+
+	/* a journal resize replaces the lanes */
+	percpu_down_read(&sbi->journal_sem);
+	seq_printf(seq, "lanes: %u\n", sbi->num_lanes);
+	for (i = 0; i < sbi->num_lanes; i++) {
+		lane = &sbi->lanes[i];
+		seq_printf(seq, "lane %u:\n", i);
+		seq_printf(seq, "  size: %u\n", lane->jsize);
+		seq_printf(seq, "  lag: %u\n", pmfs_lane_used(lane));
+		seq_printf(seq, "  max_lag: %u\n", lane->max_lag);
+		seq_printf(seq, "  fill_rate: %lu\n", lane->fill_rate);
+		seq_printf(seq, "  cleans: %lu\n", lane->nr_cleans);
+		seq_printf(seq, "  cleaned_bytes: %llu\n",
+			   lane->bytes_cleaned);
+		seq_printf(seq, "  sync_cleans: %ld\n",
+			   atomic_long_read(&lane->nr_sync_cleans));
+		seq_printf(seq, "  waits: %ld\n",
+			   atomic_long_read(&lane->nr_waits));
+	}
+	percpu_up_read(&sbi->journal_sem);
+	return 0;
+}
+
+static int pmfs_journal_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pmfs_journal_stats_show, inode->i_private);
+}
+
+static const struct file_operations pmfs_journal_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pmfs_journal_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+int pmfs_init_stats(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+
+	sbi->alloc_stats = alloc_percpu(struct pmfs_alloc_stats);
+	sbi->flush_stats = alloc_percpu(struct pmfs_flush_stats);
+	if (!sbi->alloc_stats || !sbi->flush_stats)
+		return -ENOMEM;
+	return 0;
+}
+
+/* Creates <debugfs>/pmfs/<physical address>/ for a mounted instance.
+ * Failures are not fatal; the statistics are just not visible. */
+void pmfs_register_stats(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	char name[32];
+
+	if (IS_ERR_OR_NULL(pmfs_debugfs_root))
+		return;
+	snprintf(name, sizeof(name), "0x%llx", (u64)sbi->phys_addr);
+	sbi->debugfs_dir = debugfs_create_dir(name, pmfs_debugfs_root);
+	if (IS_ERR_OR_NULL(sbi->debugfs_dir)) {
+		sbi->debugfs_dir = NULL;
+		return;
+	}
+	debugfs_create_file("alloc_stats", S_IRUSR, sbi->debugfs_dir, sb,
+			    &pmfs_alloc_stats_fops);
+	debugfs_create_file("journal_stats", S_IRUSR, sbi->debugfs_dir, sb,
+			    &pmfs_journal_stats_fops);
+}
+
+void pmfs_destroy_stats(struct super_block *sb)
+{
+	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+
+	debugfs_remove_recursive(sbi->debugfs_dir);
+	sbi->debugfs_dir = NULL;
+	free_percpu(sbi->alloc_stats);
+	sbi->alloc_stats = NULL;
+	free_percpu(sbi->flush_stats);
+	sbi->flush_stats = NULL;
+}
+
+void pmfs_init_debugfs(void)
+{
+	pmfs_debugfs_root = debugfs_create_dir("pmfs", NULL);
+}
+
+void pmfs_destroy_debugfs(void)
+{
+	debugfs_remove_recursive(pmfs_debugfs_root);
+	pmfs_debugfs_root = NULL;
+}
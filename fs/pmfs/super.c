@@ -42,6 +42,87 @@ static struct kmem_cache *pmfs_transaction_cachep;
 /* FIXME: should the following variable be one per PMFS instance? */
 unsigned int pmfs_dbgmask = 0;
 
+struct static_key pmfs_clwb_key = STATIC_KEY_INIT_FALSE;
+struct static_key pmfs_clflushopt_key = STATIC_KEY_INIT_FALSE;
+
+/* clflushopt and clwb are reported in CPUID leaf 7, EBX bits 23 and 24.
+ * clwb is preferred, as it leaves the line in the cache. */
+void pmfs_select_flush(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (boot_cpu_data.cpuid_level < 7)
+		return;
+	cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+	if (ebx & (1 << 24))
+		static_key_slow_inc(&pmfs_clwb_key);
+	else if (ebx & (1 << 23))
+		static_key_slow_inc(&pmfs_clflushopt_key);
+}
+
+const char *pmfs_flush_name(void)
+{
+	if (static_key_false(&pmfs_clwb_key))
+		return "clwb";
+	if (static_key_false(&pmfs_clflushopt_key))
+		return "clflushopt";
+	return "clflush";
+}
+
+struct static_key pmfs_emul_key = STATIC_KEY_INIT_FALSE;
+static unsigned int pmfs_emul_wlat_ns;
+static unsigned int pmfs_emul_fence_ns;
+static unsigned int pmfs_emul_bw;
+
+static void pmfs_emul_spin(u64 ns)
+{
+	u64 start = local_clock();
+
+	while (local_clock() - start < ns)
+		cpu_relax();
+}
+
+/* Writing back lines is bound either by the per-line latency or by the
+ * bandwidth cap, whichever is slower. At 1 MB/s a byte takes 1000ns. */
+void pmfs_emul_write(unsigned long lines)
+{
+	unsigned int bw = ACCESS_ONCE(pmfs_emul_bw);
+	u64 ns = (u64)lines * ACCESS_ONCE(pmfs_emul_wlat_ns);
+
+	if (bw)
+		ns = max(ns, div_u64((u64)lines * CACHELINE_SIZE * 1000, bw));
+	if (ns)
+		pmfs_emul_spin(ns);
+}
+
+void pmfs_emul_fence(void)
+{
+	unsigned int ns = ACCESS_ONCE(pmfs_emul_fence_ns);
+
+	if (ns)
+		pmfs_emul_spin(ns);
+}
+
+/* Applies the emulation options of a mount, turning the key on or off */
+static void pmfs_set_emul(struct pmfs_sb_info *sbi)
+{
+	bool on = sbi->emul_wlat || sbi->emul_fence || sbi->emul_bw;
+
+	if (on) {
+		pmfs_emul_wlat_ns = sbi->emul_wlat;
+		pmfs_emul_fence_ns = sbi->emul_fence;
+		pmfs_emul_bw = sbi->emul_bw;
+		pmfs_info("PMFS: emulating PM: %uns per line, %uns per fence, "
+			  "%u MB/s\n", sbi->emul_wlat, sbi->emul_fence,
+			  sbi->emul_bw);
+	}
+	if (on && !sbi->emul_on)
+		static_key_slow_inc(&pmfs_emul_key);
+	else if (!on && sbi->emul_on)
+		static_key_slow_dec(&pmfs_emul_key);
+	sbi->emul_on = on;
+}
+
 #ifdef CONFIG_PMFS_TEST
 static void *first_pmfs_super;
 
@@ -154,7 +235,9 @@ enum {
 	Opt_num_inodes, Opt_mode, Opt_uid,
 	Opt_gid, Opt_blocksize, Opt_wprotect, Opt_wprotectold,
 	Opt_err_cont, Opt_err_panic, Opt_err_ro,
-	Opt_hugemmap, Opt_nohugeioremap, Opt_dbgmask, Opt_err
+	Opt_hugemmap, Opt_nohugeioremap, Opt_dbgmask, Opt_group_commit,
+	Opt_journal_undo, Opt_journal_redo, Opt_pm_wlat, Opt_pm_fence,
+	Opt_pm_bw, Opt_err
 };
 
 static const match_table_t tokens = {
@@ -174,6 +257,12 @@ static const match_table_t tokens = {
 	{ Opt_hugemmap,	     "hugemmap"		  },
 	{ Opt_nohugeioremap, "nohugeioremap"	  },
 	{ Opt_dbgmask,	     "dbgmask=%u"	  },
+	{ Opt_group_commit,  "group_commit"	  },
+	{ Opt_journal_undo,  "journal=undo"	  },
+	{ Opt_journal_redo,  "journal=redo"	  },
+	{ Opt_pm_wlat,	     "pm_wlat=%u"	  },
+	{ Opt_pm_fence,	     "pm_fence=%u"	  },
+	{ Opt_pm_bw,	     "pm_bw=%u"		  },
 	{ Opt_err,	     NULL		  },
 };
 
@@ -257,9 +346,8 @@ static int pmfs_parse_options(char *options, struct pmfs_sb_info *sbi,
 			sbi->initsize = memparse(args[0].from, &rest);
 			set_opt(sbi->s_mount_opt, FORMAT);
 			break;
+		/* on remount, the journal is resized to jsize */
 		case Opt_jsize:
-			if (remount)
-				goto bad_opt;
 			/* memparse() will accept a K/M/G without a digit */
 			if (!isdigit(*args[0].from))
 				goto bad_val;
@@ -325,6 +413,38 @@ static int pmfs_parse_options(char *options, struct pmfs_sb_info *sbi,
 				goto bad_val;
 			pmfs_dbgmask = option;
 			break;
+		case Opt_group_commit:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, GROUP_COMMIT);
+			break;
+		/* the journal mode is fixed when the fs is formatted (init=) */
+		case Opt_journal_undo:
+			if (remount)
+				goto bad_opt;
+			clear_opt(sbi->s_mount_opt, REDO_LOG);
+			break;
+		case Opt_journal_redo:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, REDO_LOG);
+			break;
+		/* PM emulation settings may be changed on remount */
+		case Opt_pm_wlat:
+			if (match_int(&args[0], &option) || option < 0)
+				goto bad_val;
+			sbi->emul_wlat = option;
+			break;
+		case Opt_pm_fence:
+			if (match_int(&args[0], &option) || option < 0)
+				goto bad_val;
+			sbi->emul_fence = option;
+			break;
+		case Opt_pm_bw:
+			if (match_int(&args[0], &option) || option < 0)
+				goto bad_val;
+			sbi->emul_bw = option;
+			break;
 		default: {
 			goto bad_opt;
 		}
@@ -661,6 +781,9 @@ static int pmfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	/* Init with default values */
 	INIT_LIST_HEAD(&sbi->block_inuse_head);
+	sbi->block_inuse_tree = RB_ROOT;
+	spin_lock_init(&sbi->s_prealloc_lock);
+	INIT_LIST_HEAD(&sbi->s_prealloc_list);
 	sbi->mode = (S_IRUGO | S_IXUGO | S_IWUSR);
 	sbi->uid = current_fsuid();
 	sbi->gid = current_fsgid();
@@ -672,6 +795,11 @@ static int pmfs_fill_super(struct super_block *sb, void *data, int silent)
 	mutex_init(&sbi->s_truncate_lock);
 	mutex_init(&sbi->inode_table_mutex);
 	mutex_init(&sbi->s_lock);
+	if (pmfs_init_free_pools(sb) || pmfs_init_stats(sb) ||
+	    percpu_init_rwsem(&sbi->journal_sem)) {
+		retval = -ENOMEM;
+		goto out;
+	}
 
 	if (pmfs_parse_options(data, sbi, 0))
 		goto out;
@@ -795,14 +923,25 @@ setup_sb:
 	}
 
 	clear_opt(sbi->s_mount_opt, MOUNTING);
+	if (!(sb->s_flags & MS_RDONLY))
+		pmfs_start_zero_thread(sb);
+	pmfs_register_stats(sb);
+	pmfs_info("PMFS: flushing cache lines with %s\n", pmfs_flush_name());
+	pmfs_nt_benchmark(sb);
+	pmfs_set_emul(sbi);
 	retval = 0;
 	return retval;
 out:
 	if (sbi->virt_addr) {
+		pmfs_journal_uninit(sb);
 		pmfs_iounmap(sbi->virt_addr, initsize, pmfs_is_wprotected(sb));
 		release_mem_region(sbi->phys_addr, initsize);
 	}
 
+	free_percpu(sbi->free_pools);
+	free_percpu(sbi->alloc_stats);
+	free_percpu(sbi->flush_stats);
+	percpu_free_rwsem(&sbi->journal_sem);
 	kfree(sbi);
 	return retval;
 }
@@ -827,6 +966,8 @@ int pmfs_statfs(struct dentry *d, struct kstatfs *buf)
 	pmfs_dbg_verbose("total inodes 0x%x, free inodes 0x%x, "
 		"blocknodes 0x%lx\n", (sbi->s_inodes_count),
 		(sbi->s_free_inodes_count), (sbi->num_blocknode_allocated));
+	pmfs_dbg_verbose("free aligned 2M regions 0x%lx, 1G regions 0x%lx\n",
+		sbi->num_free_regions[0], sbi->num_free_regions[1]);
 	return 0;
 }
 
@@ -863,6 +1004,17 @@ static int pmfs_show_options(struct seq_file *seq, struct dentry *root)
 	/* xip not enabled by default */
 	if (test_opt(root->d_sb, XIP))
 		seq_puts(seq, ",xip");
+	if (test_opt(root->d_sb, GROUP_COMMIT))
+		seq_puts(seq, ",group_commit");
+	/* undo journal by default */
+	if (PMFS_SB(root->d_sb)->redo_log)
+		seq_puts(seq, ",journal=redo");
+	if (PMFS_SB(root->d_sb)->emul_wlat)
+		seq_printf(seq, ",pm_wlat=%u", PMFS_SB(root->d_sb)->emul_wlat);
+	if (PMFS_SB(root->d_sb)->emul_fence)
+		seq_printf(seq, ",pm_fence=%u", PMFS_SB(root->d_sb)->emul_fence);
+	if (PMFS_SB(root->d_sb)->emul_bw)
+		seq_printf(seq, ",pm_bw=%u", PMFS_SB(root->d_sb)->emul_bw);
 
 	return 0;
 }
@@ -873,21 +1025,45 @@ int pmfs_remount(struct super_block *sb, int *mntflags, char *data)
 	unsigned long old_mount_opt;
 	struct pmfs_super_block *ps;
 	struct pmfs_sb_info *sbi = PMFS_SB(sb);
+	uint32_t old_jsize, new_jsize;
+	unsigned int old_emul[3];
 	int ret = -EINVAL;
 
 	/* Store the old options */
 	mutex_lock(&sbi->s_lock);
 	old_sb_flags = sb->s_flags;
 	old_mount_opt = sbi->s_mount_opt;
+	old_jsize = sbi->jsize;
+	old_emul[0] = sbi->emul_wlat;
+	old_emul[1] = sbi->emul_fence;
+	old_emul[2] = sbi->emul_bw;
 
 	if (pmfs_parse_options(data, sbi, 1))
 		goto restore_opt;
+	/* sbi->jsize follows the journal, which pmfs_journal_resize()
+	 * updates once the new one is in place */
+	new_jsize = sbi->jsize;
+	sbi->jsize = old_jsize;
+	if (new_jsize != old_jsize && (*mntflags & MS_RDONLY)) {
+		printk(KERN_INFO "pmfs: cannot resize the journal read-only\n");
+		goto restore_opt;
+	}
 
 	sb->s_flags = (sb->s_flags & ~MS_POSIXACL) |
 		      ((sbi->s_mount_opt & PMFS_MOUNT_POSIX_ACL) ? MS_POSIXACL : 0);
 
 	if ((*mntflags & MS_RDONLY) != (sb->s_flags & MS_RDONLY)) {
 		u64 mnt_write_time;
+
+		/* a read-only mount leaves a journal in an older layout as
+		 * it found it */
+		if (!(*mntflags & MS_RDONLY)) {
+			percpu_down_write(&sbi->journal_sem);
+			ret = pmfs_journal_upgrade(sb);
+			percpu_up_write(&sbi->journal_sem);
+			if (ret)
+				goto restore_opt;
+		}
 		ps = pmfs_get_super(sb);
 		/* update mount time and write time atomically. */
 		mnt_write_time = (get_seconds() & 0xFFFFFFFF);
@@ -902,13 +1078,27 @@ int pmfs_remount(struct super_block *sb, int *mntflags, char *data)
 		PERSISTENT_BARRIER();
 	}
 
+	pmfs_set_emul(sbi);
 	mutex_unlock(&sbi->s_lock);
+
+	/* the zeroing thread takes s_lock, so it is started and stopped
+	 * only after the lock is dropped */
+	if (*mntflags & MS_RDONLY)
+		pmfs_stop_zero_thread(sb);
+	else
+		pmfs_start_zero_thread(sb);
 	ret = 0;
+	if (new_jsize != old_jsize)
+		ret = pmfs_journal_resize(sb, new_jsize);
 	return ret;
 
 restore_opt:
 	sb->s_flags = old_sb_flags;
 	sbi->s_mount_opt = old_mount_opt;
+	sbi->jsize = old_jsize;
+	sbi->emul_wlat = old_emul[0];
+	sbi->emul_fence = old_emul[1];
+	sbi->emul_bw = old_emul[2];
 	mutex_unlock(&sbi->s_lock);
 	return ret;
 }
@@ -926,6 +1116,15 @@ static void pmfs_put_super(struct super_block *sb)
 		first_pmfs_super = NULL;
 #endif
 
+	/* Blocks cached per-CPU or pre-zeroed must be back in the block map
+	 * before it is saved for the next fast mount */
+	pmfs_stop_zero_thread(sb);
+	pmfs_discard_all_prealloc(sb);
+	pmfs_destroy_free_pools(sb);
+	pmfs_destroy_stats(sb);
+	if (sbi->emul_on)
+		static_key_slow_dec(&pmfs_emul_key);
+
 	/* It's unmount time, so unmap the pmfs memory */
 	if (sbi->virt_addr) {
 		pmfs_save_blocknode_mappings(sb);
@@ -941,6 +1140,7 @@ static void pmfs_put_super(struct super_block *sb)
 		list_del(&i->link);
 		pmfs_free_blocknode(sb, i);
 	}
+	percpu_free_rwsem(&sbi->journal_sem);
 	sb->s_fs_info = NULL;
 	pmfs_dbgmask = 0;
 	kfree(sbi);
@@ -989,6 +1189,8 @@ static struct inode *pmfs_alloc_inode(struct super_block *sb)
 	if (!vi)
 		return NULL;
 
+	vi->i_prealloc_start = vi->i_prealloc_end = 0;
+	vi->i_prealloc_size = PMFS_PREALLOC_MIN;
 	vi->vfs_inode.i_version = 1;
 	return &vi->vfs_inode;
 }
@@ -1011,6 +1213,11 @@ static void init_once(void *foo)
 
 	vi->i_dir_start_lookup = 0;
 	INIT_LIST_HEAD(&vi->i_truncated);
+	INIT_LIST_HEAD(&vi->i_prealloc_list);
+	spin_lock_init(&vi->i_range_lock.lock);
+	INIT_LIST_HEAD(&vi->i_range_lock.ranges);
+	init_waitqueue_head(&vi->i_range_lock.wait);
+	init_rwsem(&vi->i_tree_sem);
 	inode_init_once(&vi->vfs_inode);
 }
 
@@ -1148,6 +1355,9 @@ static int __init init_pmfs_fs(void)
 {
 	int rc = 0;
 
+	pmfs_select_flush();
+	pmfs_select_nt();
+
 	rc = init_blocknode_cache();
 	if (rc)
 		return rc;
@@ -1164,6 +1374,8 @@ static int __init init_pmfs_fs(void)
 	if (rc)
 		goto out3;
 
+	pmfs_init_debugfs();
+
 	rc = register_filesystem(&pmfs_fs_type);
 	if (rc)
 		goto out4;
@@ -1171,6 +1383,7 @@ static int __init init_pmfs_fs(void)
 	return 0;
 
 out4:
+	pmfs_destroy_debugfs();
 	bdi_destroy(&pmfs_backing_dev_info);
 out3:
 	destroy_inodecache();
@@ -1184,6 +1397,7 @@ out1:
 static void __exit exit_pmfs_fs(void)
 {
 	unregister_filesystem(&pmfs_fs_type);
+	pmfs_destroy_debugfs();
 	bdi_destroy(&pmfs_backing_dev_info);
 	destroy_inodecache();
 	destroy_blocknode_cache();
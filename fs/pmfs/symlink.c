@@ -34,7 +34,7 @@ int pmfs_block_symlink(struct inode *inode, const char *symname, int len)
 	memcpy(blockp, symname, len);
 	blockp[len] = '\0';
 	pmfs_memlock_block(sb, blockp);
-	pmfs_flush_buffer(blockp, len+1, false);
+	pmfs_dirty_range(sb, blockp, len+1);
 	return 0;
 }
 
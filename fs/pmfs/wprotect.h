@@ -15,6 +15,7 @@
 
 #include <linux/pmfs_def.h>
 #include <linux/fs.h>
+#include <linux/sched.h>
 
 /* pmfs_memunlock_super() before calling! */
 static inline void pmfs_sync_super(struct pmfs_super_block *ps)
@@ -79,8 +80,31 @@ __pmfs_memlock_range(void *p, unsigned long len)
 	pmfs_writeable(p, len, 0);
 }
 
+extern void __pmfs_log_fence(struct super_block *sb,
+			     pmfs_transaction_t *trans);
+
+/* The log records of a transaction are flushed without a fence of their
+ * own. The fence is issued here instead, before the first in-place update
+ * that follows them: every such update unlocks the memory first. */
+static inline void pmfs_log_fence(struct super_block *sb)
+{
+	pmfs_transaction_t *trans = current->journal_info;
+
+	if (trans && trans->fenced != trans->used)
+		__pmfs_log_fence(sb, trans);
+}
+
 static inline void pmfs_memunlock_range(struct super_block *sb, void *p,
 					 unsigned long len)
+{
+	pmfs_log_fence(sb);
+	if (pmfs_is_protected(sb))
+		__pmfs_memunlock_range(p, len);
+}
+
+/* for the journal's writes to its own log, which need no fence */
+static inline void pmfs_memunlock_log(struct super_block *sb, void *p,
+				       unsigned long len)
 {
 	if (pmfs_is_protected(sb))
 		__pmfs_memunlock_range(p, len);
@@ -96,6 +120,7 @@ static inline void pmfs_memlock_range(struct super_block *sb, void *p,
 static inline void pmfs_memunlock_super(struct super_block *sb,
 					 struct pmfs_super_block *ps)
 {
+	pmfs_log_fence(sb);
 	if (pmfs_is_protected(sb))
 		__pmfs_memunlock_range(ps, PMFS_SB_SIZE);
 }
@@ -111,6 +136,7 @@ static inline void pmfs_memlock_super(struct super_block *sb,
 static inline void pmfs_memunlock_inode(struct super_block *sb,
 					 struct pmfs_inode *pi)
 {
+	pmfs_log_fence(sb);
 	if (pmfs_is_protected(sb))
 		__pmfs_memunlock_range(pi, PMFS_SB_SIZE);
 }
@@ -125,6 +151,7 @@ static inline void pmfs_memlock_inode(struct super_block *sb,
 
 static inline void pmfs_memunlock_block(struct super_block *sb, void *bp)
 {
+	pmfs_log_fence(sb);
 	if (pmfs_is_protected(sb))
 		__pmfs_memunlock_range(bp, sb->s_blocksize);
 }
@@ -21,8 +21,8 @@
 
 /*
  * Wrappers. We need to use the rcu read lock to avoid
- * concurrent truncate operation. No problem for write because we held
- * i_mutex.
+ * concurrent truncate operation. No problem for write because truncate
+ * takes the range lock of what it frees.
  */
 ssize_t pmfs_xip_file_read(struct file *filp, char __user *buf,
 			    size_t len, loff_t *ppos)
@@ -77,6 +77,7 @@ __pmfs_xip_file_write(struct address_space *mapping, const char __user *buf,
 		copied = bytes -
 		__copy_from_user_inatomic_nocache(xmem + offset, buf, bytes);
 		pmfs_xip_mem_protect(sb, xmem + offset, bytes, 0);
+		pmfs_emul_store(copied);
 
 		/* if start or end dest address is not 8 byte aligned, 
 	 	 * __copy_from_user_inatomic_nocache uses cacheable instructions
@@ -112,6 +113,42 @@ __pmfs_xip_file_write(struct address_space *mapping, const char __user *buf,
 	return written ? written : status;
 }
 
+/* update c_time and m_time atomically. We don't need to make the data
+ * persistent because the expectation is that the close() or an explicit
+ * fsync will do that. */
+static void pmfs_update_c_m_time(struct super_block *sb, struct inode *inode,
+	struct pmfs_inode *pi)
+{
+	u64 c_m_time;
+
+	c_m_time = (inode->i_ctime.tv_sec & 0xFFFFFFFF);
+	c_m_time = c_m_time | (c_m_time << 32);
+	pmfs_memunlock_inode(sb, pi);
+	pmfs_memcpy_atomic(&pi->i_ctime, &c_m_time, 8);
+	pmfs_memlock_inode(sb, pi);
+}
+
+/* An overwrite holds neither i_mutex nor, once its data is in place, its
+ * range lock when it gets here. The times only change once a second, so
+ * i_mutex is taken just then, which keeps them from racing with setattr
+ * and truncate. */
+static void pmfs_overwrite_update_time(struct super_block *sb,
+	struct inode *inode)
+{
+	struct timespec now = CURRENT_TIME_SEC;
+	struct pmfs_inode *pi;
+
+	if (timespec_equal(&inode->i_mtime, &now) &&
+	    timespec_equal(&inode->i_ctime, &now))
+		return;
+	mutex_lock(&inode->i_mutex);
+	pi = pmfs_get_inode(sb, inode->i_ino);
+	inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
+	pmfs_update_c_m_time(sb, inode, pi);
+	pmfs_flush_buffer(pi, 1, false);
+	mutex_unlock(&inode->i_mutex);
+}
+
 /* optimized path for file write that doesn't require a transaction. In this
  * path we don't need to allocate any new data blocks. So the only meta-data
  * modified in path is inode's i_size, i_ctime, and i_mtime fields */
@@ -128,6 +165,7 @@ static ssize_t pmfs_file_write_fast(struct super_block *sb, struct inode *inode,
 	copied = count - __copy_from_user_inatomic_nocache(xmem
 		+ offset, buf, count);
 	pmfs_xip_mem_protect(sb, xmem + offset, count, 0);
+	pmfs_emul_store(copied);
 
 	pmfs_flush_edge_cachelines(pos, copied, xmem + offset);
 
@@ -148,21 +186,87 @@ static ssize_t pmfs_file_write_fast(struct super_block *sb, struct inode *inode,
 		pmfs_memunlock_inode(sb, pi);
 		pmfs_update_time_and_size(inode, pi);
 		pmfs_memlock_inode(sb, pi);
-	} else {
-		u64 c_m_time;
-		/* update c_time and m_time atomically. We don't need to make the data
-		 * persistent because the expectation is that the close() or an explicit
-		 * fsync will do that. */
-		c_m_time = (inode->i_ctime.tv_sec & 0xFFFFFFFF);
-		c_m_time = c_m_time | (c_m_time << 32);
-		pmfs_memunlock_inode(sb, pi);
-		pmfs_memcpy_atomic(&pi->i_ctime, &c_m_time, 8);
-		pmfs_memlock_inode(sb, pi);
-	}
+	} else
+		pmfs_update_c_m_time(sb, inode, pi);
 	pmfs_flush_buffer(pi, 1, false);
 	return ret;
 }
 
+/*
+ * Overwrites of blocks that are already allocated, entirely below i_size,
+ * change no metadata but the times. They skip i_mutex and lock only the
+ * bytes they write, so writers to disjoint parts of a file run in
+ * parallel. Returns -EAGAIN if the write has to take the locked path.
+ */
+static ssize_t pmfs_xip_file_overwrite(struct file *filp,
+	const char __user *buf, size_t len, loff_t *ppos)
+{
+	struct inode *inode = filp->f_mapping->host;
+	struct super_block *sb = inode->i_sb;
+	struct pmfs_range range;
+	unsigned long blk, end_blk;
+	size_t count = len, written = 0;
+	loff_t pos = *ppos;
+	ssize_t ret;
+
+	if ((filp->f_flags & O_APPEND) ||
+	    should_remove_suid(filp->f_path.dentry))
+		return -EAGAIN;
+	if (!access_ok(VERIFY_READ, buf, len))
+		return -EFAULT;
+	/* without O_APPEND these only check pos and count against the
+	 * limits, not against i_size */
+	ret = generic_write_checks(filp, &pos, &count, 0);
+	if (ret || count == 0)
+		return ret;
+
+	/* i_size only drops under a range lock that covers the bytes being
+	 * cut off, so it stays above the write while the lock is held */
+	pmfs_range_lock(inode, &range, pos, pos + count);
+	/* the range lock keeps the blocks written to, but not the b-tree
+	 * leading to them, from changing: a locked writer elsewhere in the
+	 * file may grow the tree and a truncate may shrink it */
+	down_read(&PMFS_I(inode)->i_tree_sem);
+	ret = -EAGAIN;
+	if (pos + count > i_size_read(inode))
+		goto out;
+	end_blk = (pos + count - 1) >> sb->s_blocksize_bits;
+	for (blk = pos >> sb->s_blocksize_bits; blk <= end_blk; blk++)
+		if (!pmfs_find_data_block(inode, blk))
+			goto out;
+
+	while (written < count) {
+		size_t offset = (pos + written) & (sb->s_blocksize - 1);
+		size_t bytes = min(count - written, sb->s_blocksize - offset);
+		size_t copied;
+		void *xmem;
+
+		blk = (pos + written) >> sb->s_blocksize_bits;
+		xmem = pmfs_get_block(sb, pmfs_find_data_block(inode, blk)) +
+			offset;
+		pmfs_xip_mem_protect(sb, xmem, bytes, 1);
+		copied = bytes -
+			__copy_from_user_inatomic_nocache(xmem, buf + written,
+							  bytes);
+		pmfs_xip_mem_protect(sb, xmem, bytes, 0);
+		pmfs_emul_store(copied);
+		pmfs_flush_edge_cachelines(pos + written, copied, xmem);
+		written += copied;
+		if (copied != bytes)
+			break;
+	}
+	ret = written ? written : -EFAULT;
+	*ppos = pos + written;
+out:
+	up_read(&PMFS_I(inode)->i_tree_sem);
+	pmfs_range_unlock(inode, &range);
+	/* i_mutex is taken after the range lock is dropped, in the order
+	 * the locked path takes them */
+	if (written)
+		pmfs_overwrite_update_time(sb, inode);
+	return ret;
+}
+
 /*
  * blk_off is used in different ways depending on whether the edge block is
  * at the beginning or end of the write. If it is at the beginning, we zero from
@@ -209,9 +313,14 @@ ssize_t pmfs_xip_file_write(struct file *filp, const char __user *buf,
 	bool new_sblk = false, new_eblk = false;
 	size_t count, offset, eblk_offset, ret;
 	unsigned long start_blk, end_blk, num_blocks, max_logentries;
+	struct pmfs_range range;
+	loff_t blk_mask;
 	bool same_block;
 
 	sb_start_write(inode->i_sb);
+	ret = pmfs_xip_file_overwrite(filp, buf, len, ppos);
+	if (ret != -EAGAIN)
+		goto out_sb;
 	mutex_lock(&inode->i_mutex);
 
 	if (!access_ok(VERIFY_READ, buf, len)) {
@@ -230,6 +339,11 @@ ssize_t pmfs_xip_file_write(struct file *filp, const char __user *buf,
 
 	pi = pmfs_get_inode(sb, inode->i_ino);
 
+	/* whole blocks, as the edges of new blocks are zeroed */
+	blk_mask = pmfs_inode_blk_size(pi) - 1;
+	pmfs_range_lock(inode, &range, pos & ~blk_mask,
+			(pos + count + blk_mask) & ~blk_mask);
+
 	offset = pos & (sb->s_blocksize - 1);
 	num_blocks = ((count + offset - 1) >> sb->s_blocksize_bits) + 1;
 	/* offset in the actual block size block */
@@ -245,7 +359,7 @@ ssize_t pmfs_xip_file_write(struct file *filp, const char __user *buf,
 	if (block && same_block) {
 		ret = pmfs_file_write_fast(sb, inode, pi, buf, count, pos,
 			ppos, block);
-		goto out_backing;
+		goto out_range;
 	}
 	max_logentries = num_blocks / MAX_PTRS_PER_LENTRY + 2;
 	if (max_logentries > MAX_METABLOCK_LENTRIES)
@@ -254,14 +368,14 @@ ssize_t pmfs_xip_file_write(struct file *filp, const char __user *buf,
 	trans = pmfs_new_transaction(sb, MAX_INODE_LENTRIES + max_logentries);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
-		goto out_backing;
+		goto out_range;
 	}
 	pmfs_add_logentry(sb, trans, pi, MAX_DATA_PER_LENTRY, LE_DATA);
 
 	ret = file_remove_suid(filp);
 	if (ret) {
 		pmfs_abort_transaction(sb, trans);
-		goto out_backing;
+		goto out_range;
 	}
 	inode->i_ctime = inode->i_mtime = CURRENT_TIME_SEC;
 	pmfs_update_time(inode, pi);
@@ -293,10 +407,13 @@ ssize_t pmfs_xip_file_write(struct file *filp, const char __user *buf,
 
 	pmfs_commit_transaction(sb, trans);
 	ret = written;
+out_range:
+	pmfs_range_unlock(inode, &range);
 out_backing:
 	current->backing_dev_info = NULL;
 out:
 	mutex_unlock(&inode->i_mutex);
+out_sb:
 	sb_end_write(inode->i_sb);
 	return ret;
 }
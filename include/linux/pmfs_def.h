@@ -39,6 +39,8 @@
 #define PMFS_MOUNT_PROTECT_OLD 0x000200        /* wprotect PAGE RW Bit */
 #define PMFS_MOUNT_FORMAT      0x000400        /* was FS formatted on mount? */
 #define PMFS_MOUNT_MOUNTING    0x000800        /* FS currently being mounted */
+#define PMFS_MOUNT_GROUP_COMMIT 0x001000       /* Share commit barriers */
+#define PMFS_MOUNT_REDO_LOG    0x002000        /* format with a redo log */
 
 /*
  * Maximal count of links to a file
@@ -146,8 +148,9 @@ typedef struct pmfs_journal {
 	 * tail and gen_id must fall in the same 8-byte quadword */
 	__le32     tail;
 	__le16     gen_id;   /* generation id of the log */
-	__le16     pad;
+	__le16     num_lanes; /* 0 for a single log described by this header */
 	__le16     redo_logging;
+	__le16     log_format; /* PMFS_LOG_FORMAT_*, top level header only */
 } pmfs_journal_t;
 
 
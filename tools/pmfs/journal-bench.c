@@ -0,0 +1,191 @@
+/*
+ * journal-bench: time metadata operations on a pmfs mount
+ *
+ * Runs create, rename and append phases, each from a number of processes
+ * working in their own directory, and reports the rate of each phase. The
+ * journal mode is chosen when pmfs is formatted, so compare undo and redo
+ * logging by running it on one instance of each, e.g.
+ *
+ *   mount -t pmfs -o physaddr=0x100000000,init=4G,journal=undo none /mnt/pm
+ *   journal-bench -n 100000 -p 4 /mnt/pm
+ *   umount /mnt/pm
+ *   mount -t pmfs -o physaddr=0x100000000,init=4G,journal=redo none /mnt/pm
+ *   journal-bench -n 100000 -p 4 /mnt/pm
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; version 2.
+ *
+ * Copyright 2012-2013 Intel Corporation
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define APPEND_SIZE	64
+
+static unsigned long nr_ops = 10000;
+static int nr_procs = 1;
+static const char *root;
+
+static void fatal(const char *what, const char *path)
+{
+	fprintf(stderr, "journal-bench: %s %s: %s\n", what, path,
+		strerror(errno));
+	exit(1);
+}
+
+static void do_create(const char *dir)
+{
+	char path[PATH_MAX];
+	unsigned long i;
+	int fd;
+
+	for (i = 0; i < nr_ops; i++) {
+		snprintf(path, sizeof(path), "%s/f%lu", dir, i);
+		fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+		if (fd < 0)
+			fatal("create", path);
+		close(fd);
+	}
+}
+
+static void do_rename(const char *dir)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	unsigned long i;
+
+	for (i = 0; i < nr_ops; i++) {
+		snprintf(from, sizeof(from), "%s/f%lu", dir, i);
+		snprintf(to, sizeof(to), "%s/r%lu", dir, i);
+		if (rename(from, to))
+			fatal("rename", from);
+	}
+}
+
+static void do_append(const char *dir)
+{
+	char path[PATH_MAX], buf[APPEND_SIZE];
+	unsigned long i;
+	int fd;
+
+	memset(buf, 0x5a, sizeof(buf));
+	snprintf(path, sizeof(path), "%s/log", dir);
+	fd = open(path, O_CREAT | O_WRONLY | O_APPEND, 0644);
+	if (fd < 0)
+		fatal("open", path);
+	for (i = 0; i < nr_ops; i++)
+		if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+			fatal("append", path);
+	close(fd);
+}
+
+static void do_cleanup(const char *dir)
+{
+	char path[PATH_MAX];
+	unsigned long i;
+
+	for (i = 0; i < nr_ops; i++) {
+		snprintf(path, sizeof(path), "%s/r%lu", dir, i);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/log", dir);
+	unlink(path);
+	rmdir(dir);
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(const char *dir);
+} phases[] = {
+	{ "create", do_create },
+	{ "rename", do_rename },
+	{ "append", do_append },
+	{ "cleanup", do_cleanup },
+};
+
+/* runs one phase in every process and returns the elapsed seconds */
+static double run_phase(void (*fn)(const char *dir))
+{
+	struct timespec start, end;
+	char dir[PATH_MAX];
+	int i, status, failed = 0;
+	pid_t pid;
+
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_procs; i++) {
+		pid = fork();
+		if (pid < 0)
+			fatal("fork", "");
+		if (pid == 0) {
+			snprintf(dir, sizeof(dir), "%s/jb.%d", root, i);
+			fn(dir);
+			_exit(0);
+		}
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed = 1;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (failed)
+		exit(1);
+	return (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n ops] [-p processes] <dir>\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char dir[PATH_MAX];
+	unsigned long total;
+	double secs;
+	unsigned int i;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:p:")) != -1) {
+		switch (c) {
+		case 'n':
+			nr_ops = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			nr_procs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || !nr_ops || nr_procs < 1)
+		usage(argv[0]);
+	root = argv[optind];
+
+	for (c = 0; c < nr_procs; c++) {
+		snprintf(dir, sizeof(dir), "%s/jb.%d", root, c);
+		if (mkdir(dir, 0755) && errno != EEXIST)
+			fatal("mkdir", dir);
+	}
+
+	total = nr_ops * nr_procs;
+	printf("%-8s %12s %10s %12s\n", "phase", "ops", "seconds", "ops/s");
+	for (i = 0; i < sizeof(phases) / sizeof(phases[0]); i++) {
+		secs = run_phase(phases[i].fn);
+		printf("%-8s %12lu %10.3f %12.0f\n", phases[i].name, total,
+			secs, secs > 0 ? total / secs : 0);
+	}
+	return 0;
+}